@@ -4,6 +4,8 @@
 #include <LittleFS.h>
 #include <ArduinoOTA.h>
 #include <Wire.h>
+#include <coredecls.h>         // crc32()
+#include <limits.h>            // UINT_MAX
 // add the below libraries from the Library Manager
 #include <PubSubClient.h>
 #include <ezTime.h>
@@ -13,6 +15,17 @@
 
 #define VERSION "Ver 3.2 build 2024-02-25"
 
+// Build profiles - select with -D BUILD_PROFILE=<profile> in platformio.ini build_flags (Arduino IDE: change the default below)
+#define PROFILE_FULL 0                 // valve & pressure sensor - installed state is selectable at runtime with valveInstalled & pressureInstalled
+#define PROFILE_SENSOR_ONLY 1          // pressure sensor only - valve actuation, indicator sync & SPT are compiled out
+#define PROFILE_VALVE_ONLY 2           // valve only - I2C driver, pressure processing & SPT are compiled out
+#ifndef BUILD_PROFILE
+#define BUILD_PROFILE PROFILE_FULL
+#endif
+constexpr bool HAS_VALVE = (BUILD_PROFILE != PROFILE_SENSOR_ONLY);
+constexpr bool HAS_PRESSURE = (BUILD_PROFILE != PROFILE_VALVE_ONLY);
+constexpr bool HAS_SPT = (BUILD_PROFILE == PROFILE_FULL);
+
 // i2c pins are usually D1 & D2, but this application requires use of D1 & D2, so
 // D6 & D7 are used instead - see Valve Control Settings below for explanation
 #define I2C_ADDR 0x28
@@ -48,8 +61,14 @@
 #define MQTT_USER_NAME "watermain"                   // <<<<<<< replace with your MQTT login
 #define MQTT_PASSWORD "watermain"                    // <<<<<<< replace with your MQTT password
 #define MQTT_SERVER "haha.shencentral.net"           // <<<<<<< use either your MQTT broker DNS name or IP address surrounded by quotes
-
-#define MSG_BUFFER_SIZE 512                          // for MQTT message payload
+#define MQTT_PORT 1883
+#define MQTT_CONNECT_TIMEOUT_MS 1500                 // bounds the blocking TCP connect so a dead broker cannot stall the loop
+#define MQTT_SOCKET_TIMEOUT_SECS 2                   // bounds the wait for the broker's CONNACK
+#define MQTT_BACKOFF_MIN_MS 1000                     // first reconnect delay - doubles after every failure...
+#define MQTT_BACKOFF_MAX_MS 60000                    // ...up to this, plus up to 50% random jitter
+#define MQTT_BROKER_FAILOVER_ATTEMPTS 3              // consecutive failures on one broker before moving to the next in mqttBrokers[]
+
+#define MSG_BUFFER_SIZE 1024                         // for MQTT message payload
 #define VERSION_TOPIC "watermain/report/version"     // report software version at connect
 #define LAST_BOOT_TOPIC "watermain/report/last_boot" // send boot (not reconnect) time to broker when connected
 #define LWT_TOPIC "watermain/status/LWT"             // MQTT Last Will & Testament
@@ -62,7 +81,25 @@
 #define LAST_VALVE_STATE_UNK_TOPIC "watermain/report/last_unk_valve_state"     // send timestamp if valve state cannot be determined from indicator inputs
 #define SPT_DATA_STATUS_TOPIC "watermain/spt_data_status"                      // 0 when test in progress, 1 when finished
 #define SPT_RESULT_TOPIC "watermain/spt_result"                                // send at end of Static Pressure Test - end pressure minus start pressure
+#define SPT_COMPENSATED_TOPIC "watermain/spt_result_compensated"               // SPT result with the water temperature effect removed
+#define SPT_SCHEDULE_TOPIC "watermain/report/spt_next"                         // local time of the next on-device scheduled SPT
+#define DEMAND_HIST_TOPIC "watermain/report/demand_histogram"                  // learned demand events per weekday (Sun..Sat) & hour
+#define FIXTURE_EVENT_TOPIC "watermain/fixture_event"                           // one JSON record per detected water draw
+#define FIXTURE_COUNTS_TOPIC "watermain/report/fixture_counts"                 // draws per fixture type for the day - published at midnight & on fixtureReport
+#define FIXTURE_ALERT_TOPIC "watermain/report/fixture_alert"                   // timestamp & details when a toilet keeps refilling by itself
+#define PASSIVE_LEAK_TOPIC "watermain/passive_leak_score"                      // nightly 0-100 leak likelihood from the quiet window, statistics under /attributes
+#define VALVE_HEALTH_TOPIC "watermain/report/valve_health"                     // travel time trend & stall prediction after every actuation
+#define VALVE_WARNING_TOPIC "watermain/report/valve_warning"                   // timestamp & details when the valve is slowing down or stalled
+#define VALVE_TRACE_TOPIC "watermain/report/valve_trace"                       // per-command valve latency trace, rolling statistics under /stats
+#define LAST_RESET_TOPIC "watermain/report/last_reset"                        // reset reason, crash breadcrumb & what was restored from RTC memory
+#define EVENTS_TOPIC "watermain/report/events"                                 // paged event journal records in answer to the events command
+#define MQTT_STATS_TOPIC "watermain/report/mqtt_stats"                        // this unit's broker load - messages, bytes, retained & reconnects
+#define PONG_TOPIC "watermain/report/pong"                                     // echoes the ping command payload for round-trip timing
+#define SET_PARAMS_TOPIC "watermain/report/set_params"                        // outcome of a setParams batch
+#define LEAK_TRIP_TOPIC "watermain/report/leak_trip"                          // which remote leak sensor closed the valve & how fast
+#define LEAK_SENSORS_TOPIC "watermain/report/leak_sensors"                     // configured remote leak sensors in answer to leakSensorList
 #define RECV_COMMAND_TOPIC "watermain/cmd/#"
+#define CMD_TOPIC_PREFIX "watermain/cmd/"                                      // only topics under this are commands - others are leak sensors
 
 // Operational parameters & preferences
 #define PREFER_FAHRENHEIT 1                          // temperature reported in Celsius unless this is set to 1
@@ -70,20 +107,103 @@
 #define INITIAL_PRESSURE_SENSOR_INSTALLED_STATE 1    // 1 if installed, 0 if not - runtime state can be changed & saved in NVRAM via MQTT command
 #define PARAMS_FILENAME "/params.bin"
 #define VALVE_STATE_FILENAME "/valve_state.bin"
+#define DEMAND_HIST_FILENAME "/demand_hist.bin"
+#define VALVE_HEALTH_FILENAME "/valve_health.bin"
+#define SPT_THERMAL_FILENAME "/spt_thermal.bin"
+#define JOURNAL_FILENAME "/events.bin"
+#define JOURNAL_MAGIC 0x4A524E31                     // "JRN1" - file is recreated if this or the size does not match
+#define JOURNAL_RECORDS 512                          // circular event journal capacity (16 bytes per record)
+#define JOURNAL_INDEX_STRIDE 32                      // RAM time index keeps the timestamp of every 32nd slot
+#define JOURNAL_REPEAT_SECS 600                      // a repeated valve unknown / pressure fault within this time is journaled once (protects flash)
+#define JOURNAL_PAGE_MAX (MSG_BUFFER_SIZE - 5 - 2 - (int)strlen(EVENTS_TOPIC) - 24) // MQTT header, topic & closing fields
+#define JOURNAL_DEFAULT_QUERY_SECS 86400             // events command with no range returns the last 24 hours
+
+// Event journal record types
+#define EVENT_BOOT 1                                 // detail = reset reason, value = loop breadcrumb at a warm reset (-1 if none)
+#define EVENT_VALVE 2                                // detail = new state, value = msecs to indicator confirmation (-1 if none), value2 = 1 if closed by OTA protection
+#define EVENT_VALVE_UNK 3                            // valve state could not be determined from indicators
+#define EVENT_PRESSURE_FAULT 4                       // pressure sensor could not be read
+#define EVENT_SPT_START 5                            // value = beginning pressure
+#define EVENT_SPT_RESULT 6                           // value = result (PSI), value2 = test minutes
+#define EVENT_SPT_ABORT 7                            // detail = 0 manual intervention, 1 water demand, 2 ended during a restart
+#define EVENT_PASSIVE_SCORE 8                        // value = passive leak score (-1 if not valid)
+#define EVENT_FIXTURE_ALERT 9                        // value = last toilet refill interval (minutes)
+#define EVENT_VALVE_WARNING 10                       // detail = VALVE_SERIES_xxx, value = recent msecs (-1 stalled), value2 = baseline msecs
+#define EVENT_VALVE_EXERCISE 11                      // detail = mode + 2 if aborted on demand, value = breakaway msecs (-1 if none)
+#define EVENT_LEAK_TRIP 12                           // detail = leak sensor slot, value = msecs receipt to relay, value2 = msecs receipt to closed indicator (-1 if none)
+#define EVENT_RTC_DISCARDED 13                       // value = consecutive warm restarts - restored state was not resumed
 #define OPEN_VALVE 1
 #define CLOSE_VALVE 0
 #define PRESSURE_SETTLING_DELAY_MS 2000              // wait for pressure to settle a bit after closing valve for SPT
 #define VALVE_ROTATION_TIME_MS 10000                 // time required for valve to open/close - relays are only active long enough for the valve to rotate
 #define VALVE_ERROR_DEFAULT 0                        // 0=CLOSED, 1=OPEN - how the valve will default if everything goes badly - also used if manual switch has left valve between OPEN/CLOSED
+#define LEAK_SENSOR_MAX 4                            // remote leak sensors the controller subscribes to directly
+#define LEAK_TOPIC_LEN 64                            // max topic length + 1 - exact topics, no wildcards
+#define LEAK_PAYLOAD_LEN 24                          // max trip payload length + 1 - the sensor trips when its payload contains this
+#define DEFAULT_VALVE_EXERCISE_DAYS 7                // exercise the valve this often so it cannot seize - 0 = never
+#define DEFAULT_VALVE_EXERCISE_MODE 0                // 0 = partial close & reopen, 1 = full close & reopen
+#define VALVE_RELAY_DEADTIME_MS 50                   // both relays off this long before the opposite one is energized (break before make)
+#define VALVE_EXERCISE_PARTIAL_MS 3000               // partial exercise drives the valve toward closed this long after it leaves the open stop
+#define VALVE_EXERCISE_SLOT_OFFSET_MIN 35            // minutes into the learned quietest hour - clear of an auto-scheduled SPT
+#define VALVE_EXERCISE_CHECK_MS 60000                // how often loop() checks whether an exercise is due
+#define VALVE_HEALTH_MAGIC 0x564C5631                // "VLV1" - trend file is recreated if this does not match
+#define VALVE_TREND_WINDOW 16                        // travel time samples kept per series for the trend
+#define VALVE_TREND_BASELINE 8                       // first samples of a series are averaged into its healthy baseline
+#define VALVE_TREND_RECENT 4                         // samples averaged for comparison against the baseline
+#define VALVE_TRAVEL_WARN_PERCENT 25                 // warn when recent travel is this much slower than the baseline...
+#define VALVE_STALL_WARN_ACTUATIONS 20               // ...or the trend reaches VALVE_ROTATION_TIME_MS within this many actuations
+#define VALVE_SERIES_CLOSE 0                         // indicator-to-indicator travel, open stop to closed stop
+#define VALVE_SERIES_OPEN 1                          // indicator-to-indicator travel, closed stop to open stop
+#define VALVE_SERIES_BREAKAWAY 2                     // relay energized to leaving the open stop - first sign of a sticking ball
 #define VALVE_SYNC_INTERVAL_MS 30000                 // how often actual valve switch will be checked & synced with software valveState (in case manual button has been used)
+#define VALVE_TRACE_WINDOW 16                        // number of recent valve commands per direction used for latency statistics
 #define DEFAULT_IDLE_PUBLISH_INTERVAL_MS 300000      // how often sensor data is published if no event driven changes
 #define DEFAULT_MIN_PUBLISH_INTERVAL_MS 5000         // don't publish more often than this in non-SPT operation
 #define SPT_MIN_PUBLISH_INTERVAL_MS 1000             // don't publish more often than this during SPT
 #define PRESSURE_SENSOR_FAULT_PUB_INTERVAL_MS 60000  // how often a pressure sensor error (timestmap) is published if error condition true
 #define DEFAULT_SENSOR_READ_INTERVAL_MS 500          // how often the sensor is read (how soon PSI changes are recognized)
+#define DEFAULT_ADAPTIVE_SAMPLING 0                  // 1 = sensor read rate follows pressure dynamics between fastReadInterval & slowReadInterval, 0 = fixed sensorReadInterval
+#define DEFAULT_FAST_READ_INTERVAL_MS 50             // adaptive sampling read interval during a pressure transient (20 Hz)
+#define DEFAULT_SLOW_READ_INTERVAL_MS 2000           // adaptive sampling read interval floor when pressure is stable
+#define DEFAULT_ADAPTIVE_SLOPE_THRESHOLD .5          // PSI/sec - pressure slope that switches adaptive sampling to fastReadInterval
+#define ADAPTIVE_STDDEV_THRESHOLD_PSI .15            // pressure standard deviation that switches adaptive sampling to fastReadInterval
+#define ADAPTIVE_WINDOW 8                            // number of recent samples used for adaptive sampling slope & variance
+#define DEFAULT_PUBLISH_MODE 0                       // 0 = publish on sptPressureDrop change or idlePublishInterval, 1 = swinging door compression with idlePublishInterval heartbeat
+#define DEFAULT_SDT_DEVIATION .1                     // PSI - swinging door error bound, published points reconstruct the sampled curve within this tolerance
+#define SDT_MIN_EMIT_INTERVAL_MS 1000                // swinging door never publishes more often than this - a newer point replaces a held one
+#define DEFAULT_PASSIVE_START_HOUR 1                 // local hour the nightly passive leak estimation window opens...
+#define DEFAULT_PASSIVE_END_HOUR 5                   // ...and closes (score is published then) - set both equal to disable
+#define DEMAND_DROP_PSI 2.0                          // pressure this far below the static baseline is treated as water demand
+#define BASELINE_RISE_TAU_MS 5000                    // static pressure baseline follows rising pressure quickly...
+#define BASELINE_FALL_TAU_MS 120000                  // ...and falling pressure slowly, and freezes during a draw (FIXTURE_START_DROP_PSI)
+#define PASSIVE_MICRO_DROP_PSI .15                   // a dip this far below baseline (but short of DEMAND_DROP_PSI) is a micro-drop
+#define PASSIVE_MIN_QUIET_MINUTES 60                 // zero-demand minutes needed in the window for a valid score
+#define PASSIVE_RATE_SCALE 2.0                       // micro-drops per quiet hour that give ~63% of the rate component of the score
+#define PASSIVE_SUSPICIOUS_SCORE 50                  // scores at or above this are flagged suspicious - worth an active SPT
+#define FIXTURE_START_DROP_PSI .75                   // a draw starts when pressure falls this far below the static baseline...
+#define FIXTURE_END_DROP_PSI .3                      // ...and ends once it has recovered to within this...
+#define FIXTURE_END_HOLD_MS 3000                     // ...for this long
+#define FIXTURE_MIN_DURATION_MS 2000                 // shorter draws are ignored as glitches
+#define FIXTURE_MAX_DRAW_MS 7200000                  // a "draw" this long is a supply pressure step - baseline restarts from current pressure
+#define FIXTURE_TOILET_REPEAT_MIN 25                 // toilet refills closer together than this with no other use...
+#define FIXTURE_TOILET_REPEAT_COUNT 3                // ...this many times in a row raise a fixture alert (flapper leak)
+#define ADAPTIVE_HOLD_MS 5000                        // stay fast this long after the last transient, then double the interval each sample until slowReadInterval
 #define DEFAULT_SPT_REPORT_PSI_DROP .3               // amount of change in PSI to initiate a publishing event
 #define DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP 30     // percent of sudden pressure drop during Static Pressure Test required to assume pressure drop is intentional (water is needed)
 #define DEFAULT_SPT_TEST_DURATION_MINUTES 10         // duration of Static Pressure Test (valve off & observe pressure change)
+#define DEFAULT_SPT_AUTO_SCHEDULE 0                  // 1 = device schedules its own daily SPT in the learned lowest-demand hour
+#define SPT_SCHEDULE_MIN_EVENTS 50                   // demand events to learn before trusting the histogram...
+#define SPT_SCHEDULE_DEFAULT_HOUR 3                  // ...until then SPTs are scheduled at this local hour
+#define SPT_SCHEDULE_SLOT_OFFSET_MIN 5               // minutes into the chosen hour the SPT starts
+#define SPT_SCHEDULE_MIN_GAP_HOURS 12                // after a valid SPT the next one is at least this far away
+#define SPT_SCHEDULE_MAX_BACKOFF_HOURS 24            // retry after an abort waits 1, 2, 4... hours up to this
+#define DEFAULT_SPT_THERMAL_MODE 2                   // 0 = no compensation, 1 = sptThermalCoeff, 2 = coefficient fitted from past tests (sptThermalCoeff until fitted)
+#define DEFAULT_SPT_THERMAL_COEFF 0.0                // PSI per degree C of water temperature change in the closed system
+#define SPT_THERMAL_MAGIC 0x54484D31                 // "THM1" - history file is recreated if this does not match
+#define SPT_THERMAL_HISTORY 16                       // valid tests kept for fitting the coefficient
+#define SPT_THERMAL_MIN_TESTS 6                      // tests needed before the fitted coefficient is used...
+#define SPT_THERMAL_MIN_SPREAD 0.0004                // ...and the variance of their temperature rates ((C/min)^2) must exceed this
+#define SPT_THERMAL_TIGHT_PSI 3.0                    // tests that lost more than this are leaks, not thermal drift - left out of the fit
 #define SPT_DATA_IN_PROCESS "in_process"             // SPT test is in process and the reported SPT result is old
 #define SPT_DATA_VALID "valid"                       // SPT test has completed normally and the SPT result is valid
 #define SPT_DATA_ABORTED "aborted"                   // SPT test has terminated abnormally and resultant data is not valid (test must be run again)
@@ -91,16 +211,50 @@
 
 #define TIMEZONE_EEPROM_OFFSET 0                     // location-to-timezone info - saved in case eztime server is down
 
+#define OTA_PROTECT_READ_INTERVAL_MS 100             // pressure is sampled this often between OTA flash chunks
+#define OTA_BURST_DROP_PERCENT 50                    // during OTA, a fall of this percent below the pre-update pressure...
+#define OTA_BURST_HOLD_MS 10000                      // ...lasting this long is treated as a burst and the valve is closed
+
+#define MQTT_STATS_INTERVAL_MS 900000                // publish this unit's broker load every 15 minutes
+#define MQTT_PUBLISH_OVERHEAD_BYTES 4                // fixed header & topic length bytes added to every PUBLISH (short messages)
+
+#define RTC_BREADCRUMB_OFFSET 32                     // RTC user memory block (4 bytes each) - blocks 0-31 are used by the OTA bootloader
+#define RTC_SNAPSHOT_OFFSET 34                       // snapshot follows the 2 breadcrumb blocks
+#define RTC_SNAPSHOT_LAYOUT 1                        // bump whenever struct RtcSnapshot changes
+#define RTC_SNAPSHOT_MAGIC (0x52540000 + (RTC_SNAPSHOT_LAYOUT << 8) + sizeof(RtcSnapshot)) // "RT" + layout & size - a snapshot from other firmware is ignored
+#define RTC_MAX_WARM_RESTARTS 3                      // consecutive warm resets restoring state before it is discarded (restored state may be the crash)
+#define RTC_STABLE_RUN_MS 600000                     // running this long clears the warm reset count
+#define RTC_SNAPSHOT_INTERVAL_MS 250                 // runtime state is copied to RTC memory this often - no flash writes
+#define RTC_SPT_RESUME_MIN_SECS 5                    // an SPT with less than this left at a warm restart is aborted instead of resumed
+
+// Loop section breadcrumbs - the last one written before a crash is reported at the next boot
+#define BC_NONE 0
+#define BC_SETUP 1
+#define BC_EVENTS 2
+#define BC_MQTT 3
+#define BC_CALLBACK 4
+#define BC_VALVE 5
+#define BC_SENSOR 6
+#define BC_PUBLISH 7
+#define BC_SPT 8
+#define BC_IDLE 9
+
 #define DEBUG_SPT false                               // Disable valve synce for testing <<<<<  DON'T FORGET TO CHANGE THIS BACK TO false AFTER TESTING <<<<<<<<<<<<<
 
 char msg[MSG_BUFFER_SIZE];
 char lastBoot[50];
 unsigned long lastReconnectAttempt = 0;
+unsigned long mqttBackoff = MQTT_BACKOFF_MIN_MS, mqttRetryDelay = 0;
+const char *mqttBrokers[] = { MQTT_SERVER };         // <<<<<<< ordered failover list - add backup brokers after the primary
+byte mqttBrokerIndex = 0, mqttBrokerFailures = 0;
+byte postConnectStage = 0;                           // non-zero while post-connect announcements are still being sent, one stage per loop
+boolean mqttWasConnected = false;
 unsigned long lastPublish = 0, lastRead = 0, lastValveSync = 0, lastPressErrReport = 0;
 unsigned long tempNow, lastPublishNow, sensorReadNow, mqttNow, valveNow, lastValveSyncNow, lastPressErrReportNow;
 byte sensorStatus;
 float psiTminus0 = 0, psiTminus1 = 0, psiTminus2 = 0;            // psiTminus0 is the current pressure, psiTminus1 is the previous, psiTminus2 is the one before
 float medianPressure, sptBeginningPressure, temperature;
+float sensorTempC;               // latest sensor temperature in C - temperature is converted in place for publishing
 unsigned int pre_spt_idlePublishInterval, pre_spt_minPublishInterval;
 
 struct Parameters
@@ -114,142 +268,1462 @@ struct Parameters
   float sptPressureDrop;
   float sptDemandWaterPercentDrop;
   unsigned int sptDuration;
+  unsigned int adaptiveSampling;
+  unsigned int fastReadInterval;
+  unsigned int slowReadInterval;
+  float adaptiveSlopeThreshold;
+  unsigned int publishMode;
+  float sdtDeviation;
+  unsigned int passiveStartHour;
+  unsigned int passiveEndHour;
+  unsigned int sptAutoSchedule;
+  unsigned int valveExerciseDays;
+  unsigned int valveExerciseMode;
+  unsigned int sptThermalMode;
+  float sptThermalCoeff;
+  char leakTopic[LEAK_SENSOR_MAX][LEAK_TOPIC_LEN];     // empty slot = unused
+  char leakPayload[LEAK_SENSOR_MAX][LEAK_PAYLOAD_LEN];
   byte filler;  // NVM requires even number of bytes for storage
 };
 
 struct Parameters opParams;
 
+// Installed hardware - fixed by the build profile, except in PROFILE_FULL where the runtime parameters decide
+inline bool hasValve()
+{
+  if constexpr (BUILD_PROFILE == PROFILE_FULL)
+    return (opParams.valveInstalled == 1);
+  else
+    return HAS_VALVE;
+}
+
+inline bool hasPressure()
+{
+  if constexpr (BUILD_PROFILE == PROFILE_FULL)
+    return (opParams.pressureInstalled == 1);
+  else
+    return HAS_PRESSURE;
+}
+
+unsigned long activeReadInterval = DEFAULT_SENSOR_READ_INTERVAL_MS; // sensor read interval currently in effect
+unsigned long lastTransient = 0;
+float adaptPsi[ADAPTIVE_WINDOW];
+unsigned long adaptMs[ADAPTIVE_WINDOW];
+unsigned int adaptCount = 0;
+
+struct SwingingDoor
+{
+  boolean started;
+  unsigned long archMs, prevMs;  // last archived (published) point and last sample
+  float archP, prevP;
+  float upper, lower;            // narrowest door slopes (PSI/sec) since the archived point
+  boolean pending;               // archived point waiting for SDT_MIN_EMIT_INTERVAL_MS
+  float pendingP;
+};
+
+struct SwingingDoor sdt;
+
+float sampleRaw[3], filteredPressure;   // last three raw samples and their median
+unsigned int sampleCount = 0;
+float pressureBaseline = 0;             // static (no demand) pressure estimate
+unsigned long baselineMs;
+
+struct PassiveLeak
+{
+  boolean active;                       // inside the quiet window & accumulating
+  unsigned long minuteStartMs;
+  float minuteMin;
+  unsigned int quietMinutes, demandMinutes;
+  boolean inDrop;                       // micro-drop in progress
+  unsigned long dropStartMs, troughMs, lastDropMs;
+  float troughDepth;
+  unsigned int drops;
+  float sumDepth, sumRecoverySecs;
+  unsigned int intervals;
+  float intervalMean, intervalM2;       // Welford running mean & variance of minutes between micro-drops
+};
+
+struct PassiveLeak passive;
+
+byte demandHist[7][24];                 // demand events per [weekday 0=Sunday][local hour] - halved when a bin saturates
+boolean demandHistDirty = false, demandActive = false;
+unsigned int demandHistSavedHour = 24;
+unsigned int sptScheduleRetries = 0;    // consecutive aborted or refused scheduled SPTs
+
+struct FixtureTemplate
+{
+  const char *name;
+  float minSecs, maxSecs;               // plausible draw duration
+  float minDepth, maxDepth;             // plausible pressure drop below baseline (PSI)
+};
+
+// Small on-device template set - tune the ranges to your plumbing from the FIXTURE_EVENT_TOPIC records
+const FixtureTemplate fixtureTemplates[] = {
+    {"faucet", 2, 45, .75, 6},
+    {"toilet", 10, 120, 1, 8},
+    {"washer_fill", 45, 300, 3, 15},
+    {"shower", 240, 1800, 2, 12},
+    {"irrigation", 600, 5400, 5, 40},
+};
+#define FIXTURE_TYPES (sizeof(fixtureTemplates) / sizeof(fixtureTemplates[0]))
+
+struct FixtureDetector
+{
+  boolean inDraw;
+  unsigned long startMs, recoveredMs;   // recoveredMs is 0 until pressure is back within FIXTURE_END_DROP_PSI
+  float depth, sumDrop;
+  unsigned int samples;
+  unsigned int dailyCounts[FIXTURE_TYPES + 1];   // last slot counts unknown draws
+  float dailyMinutes;
+  int countsDay;                        // day of year the counts belong to
+  char countsDate[11];                  // the same day as Y-m-d - published with the counts after midnight has passed
+  unsigned long lastToiletMs;
+  unsigned int toiletRepeats;
+};
+
+struct FixtureDetector fixture = {false, 0, 0, 0, 0, 0, {0}, 0, -1, "", 0, 0};
+
 byte valvePreSPT, valveState = VALVE_ERROR_DEFAULT; // if all saved data is lost, VALVE_ERROR_DEFAULT is the valve setting
+boolean valveUnknownJournaled = false; // the current half open spell is already in the journal
+
+// True if water can flow from the supply - always when there is no valve to close it
+inline bool supplyOpen()
+{
+  return (!hasValve()) || (valveState == OPEN_VALVE);
+}
 unsigned int sptConsecAborts = 0;
+time_t sptDeadline = 0;          // UTC epoch the running SPT ends
+unsigned long valveEnergizedAt, valveConfirmedAt, valvePublishedAt; // millis() stamps of the last applyValveState() - valveConfirmedAt is 0 if indicator never confirmed
+unsigned long valveDepartedAt;   // millis() the starting end stop indicator dropped - 0 if the valve did not start at an end stop or never left it
+
+struct ValveHealth               // persisted travel time trend - one file write per actuation
+{
+  uint32_t magic;
+  uint16_t travel[3][VALVE_TREND_WINDOW];  // msecs ring per VALVE_SERIES_xxx
+  uint16_t count[3];                       // samples ever recorded per series
+  float baseline[3];                       // mean of the first VALVE_TREND_BASELINE samples
+  uint16_t stalls[2];                      // actuations per direction that never reached the far end stop
+  uint32_t lastExercise;                   // UTC epoch of the last completed exercise
+};
+
+struct ValveHealth valveHealth;
+
+struct ValveExercise
+{
+  byte stage;                     // 0 idle, 1 closing, 2 relay dead time, 3 reopening
+  boolean demandAbort;
+  unsigned long stageAt, departedAt, arrivedAt, breakawayMs;
+  float startPressure;
+};
+
+struct ValveExercise valveExercise;
+
+struct ValveResync              // post-connect drive of a half open valve to its saved state, polled from loop()
+{
+  boolean active;
+  byte target;
+  unsigned long startedAt;
+};
+struct ValveResync valveResync = {false, 0, 0};
+unsigned long lastExerciseCheck = 0;
+
+struct RtcSnapshot              // runtime state kept in RTC user memory across warm resets
+{
+  uint32_t magic;
+  uint32_t warmRestarts;         // consecutive warm resets without RTC_STABLE_RUN_MS of running in between
+  uint32_t savedAt;              // UTC epoch
+  uint32_t sptDeadline;          // UTC epoch the running SPT ends - 0 if none
+  float sptBeginningPressure, medianPressure;
+  float sampleRaw[3], filteredPressure, pressureBaseline;
+  float psiTminus1, psiTminus2;
+  uint32_t sampleCount;
+  uint32_t sptConsecAborts, preSptIdlePublishInterval, preSptMinPublishInterval;
+  uint32_t mqttMsgs, mqttBytes, mqttConnects;
+  byte valveState, valvePreSPT, sptStatus, reserved;  // sptStatus 0 not_valid, 1 in_process, 2 valid, 3 aborted
+  uint32_t crc;                  // crc32 of everything above
+};
+
+struct RtcSnapshot rtcSnap;
+unsigned long lastRtcSave = 0;
+uint32_t rtcBreadcrumbNow = BC_NONE;
+int rtcBreadcrumbAtReset = -1;   // -1 unless the reset was warm and a breadcrumb survived
+boolean rtcSnapValid = false, rtcResetReported = false;
+boolean rtcSnapDiscarded = false; // too many warm resets in a row - the snapshot was not used
+uint32_t rtcWarmRestarts = 0;     // consecutive warm resets at this boot
+byte rtcSptAction = 0;           // 0 none, 1 SPT resumed, 2 SPT aborted
+
+//   ***************************
+//   **   rtcBreadcrumb()     **
+//   ***************************
+
+// Records the loop section being entered - a word & its complement, so a torn or random value is not trusted
+inline void rtcBreadcrumb(uint32_t section)
+{
+  if (section == rtcBreadcrumbNow)
+    return;
+  rtcBreadcrumbNow = section;
+  uint32_t crumb[2] = {section, ~section};
+  ESP.rtcUserMemoryWrite(RTC_BREADCRUMB_OFFSET, crumb, sizeof(crumb));
+}
+
+struct JournalRecord
+{
+  uint32_t time;                  // UTC epoch seconds
+  uint16_t seq;                   // write sequence - orders records within the same second
+  byte type;                      // EVENT_xxx
+  byte detail;                    // small type-specific value
+  float value, value2;            // type-specific values
+};
+
+struct JournalHeader
+{
+  uint32_t magic;
+  uint16_t head;                  // next slot to write
+  uint16_t count;                 // valid records, up to JOURNAL_RECORDS
+  uint16_t seq;
+  uint16_t filler;
+};
+
+struct JournalHeader journal;
+uint32_t journalIndex[JOURNAL_RECORDS / JOURNAL_INDEX_STRIDE]; // time of the record in slot i * JOURNAL_INDEX_STRIDE
+struct JournalRecord journalRepeat[2]; // last journaled valve unknown [0] & pressure fault [1] - rate limited per type
+
+struct OtaProtect
+{
+  float startPressure;            // filtered pressure when the update began
+  float raw[3];                   // median-of-three glitch filter
+  unsigned int count;
+  unsigned long lastReadMs, burstSinceMs;
+  unsigned long valveCloseAt;     // non-zero while the close relay is energized
+  boolean valveClosed;            // protection closed the valve during this update
+};
+
+struct OtaProtect ota;
+
+struct JournalQuery
+{
+  boolean active;                 // pages still to publish
+  uint16_t next;                  // next record, counted from the oldest
+  uint32_t start, end;
+  unsigned int page;
+};
+
+struct JournalQuery journalQuery;
+
+struct ValveTrace
+{
+  char id[24];                    // optional correlation ID supplied with the command
+  unsigned long recvMs;           // millis() at MQTT receipt in callback()
+};
+
+struct ValveTrace valveTrace;
+unsigned long valveTraceLatency[2][VALVE_TRACE_WINDOW]; // receipt-to-indicator latency, indexed by [state][slot]
+unsigned int valveTraceCount[2] = {0, 0}, valveTraceUnconfirmed[2] = {0, 0};
 char sptDataStatus[12];
 File paramFileObj, valveFileObj;
 WiFiClient espClient;
-PubSubClient mqttClient(espClient);
+// PubSubClient that tallies what this unit sends to the broker, so the cost of each telemetry setting
+// can be measured and multiplied out across a fleet of controllers sharing one broker
+class CountingMqttClient : public PubSubClient
+{
+public:
+  using PubSubClient::PubSubClient;
+  unsigned long msgs = 0, bytes = 0, retainedMsgs = 0, retainedBytes = 0;
+
+  boolean publish(const char *topic, const char *payload)
+  {
+    return (publish(topic, payload, false));
+  }
+  boolean publish(const char *topic, const char *payload, boolean retained)
+  {
+    unsigned long n = strlen(topic) + strlen(payload) + MQTT_PUBLISH_OVERHEAD_BYTES;
+    msgs++;
+    bytes += n;
+    if (retained)
+    {
+      retainedMsgs++;
+      retainedBytes += n;
+    }
+    return (PubSubClient::publish(topic, payload, retained));
+  }
+};
+
+struct MqttStats
+{
+  unsigned long connects, attempts, received, receivedBytes;
+  unsigned long lastReportMs, lastMsgs, lastBytes;
+};
+
+CountingMqttClient mqttClient(espClient);
+struct MqttStats mqttStats;
 Timezone myTZ;
 
 //   ***************************
-//   **  WiFi initialization  **
+//   **  setDefaultParams()   **
 //   ***************************
 
-void setup_wifi()
+void setDefaultParams()
 {
-  delay(10); // let Serial comm stream start before using it
+  strcpy(opParams.version, VERSION);
+  opParams.valveInstalled = INITIAL_VALVE_INSTALLED_STATE;
+  opParams.pressureInstalled = INITIAL_PRESSURE_SENSOR_INSTALLED_STATE;
+  opParams.idlePublishInterval = DEFAULT_IDLE_PUBLISH_INTERVAL_MS;
+  opParams.minPublishInterval = DEFAULT_MIN_PUBLISH_INTERVAL_MS;
+  opParams.sensorReadInterval = DEFAULT_SENSOR_READ_INTERVAL_MS;
+  opParams.sptPressureDrop = (float)DEFAULT_SPT_REPORT_PSI_DROP;
+  opParams.sptDemandWaterPercentDrop = (float)DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP;
+  opParams.sptDuration = DEFAULT_SPT_TEST_DURATION_MINUTES;
+  opParams.adaptiveSampling = DEFAULT_ADAPTIVE_SAMPLING;
+  opParams.fastReadInterval = DEFAULT_FAST_READ_INTERVAL_MS;
+  opParams.slowReadInterval = DEFAULT_SLOW_READ_INTERVAL_MS;
+  opParams.adaptiveSlopeThreshold = (float)DEFAULT_ADAPTIVE_SLOPE_THRESHOLD;
+  opParams.publishMode = DEFAULT_PUBLISH_MODE;
+  opParams.sdtDeviation = (float)DEFAULT_SDT_DEVIATION;
+  opParams.passiveStartHour = DEFAULT_PASSIVE_START_HOUR;
+  opParams.passiveEndHour = DEFAULT_PASSIVE_END_HOUR;
+  opParams.sptAutoSchedule = DEFAULT_SPT_AUTO_SCHEDULE;
+  opParams.valveExerciseDays = DEFAULT_VALVE_EXERCISE_DAYS;
+  opParams.valveExerciseMode = DEFAULT_VALVE_EXERCISE_MODE;
+  opParams.sptThermalMode = DEFAULT_SPT_THERMAL_MODE;
+  opParams.sptThermalCoeff = (float)DEFAULT_SPT_THERMAL_COEFF;
+  memset(opParams.leakTopic, 0, sizeof(opParams.leakTopic));
+  memset(opParams.leakPayload, 0, sizeof(opParams.leakPayload));
+}
 
-  // We start by connecting to a WiFi network
+boolean leakWet[LEAK_SENSOR_MAX];       // last message from the sensor contained its trip text - sensors repeat their state
 
-  WiFi.mode(WIFI_STA);
-  WiFi.setHostname(DEVICE_NAME);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+//   ***************************
+//   **   leakSensorCount()   **
+//   ***************************
 
-  Serial.print(F("\nWaiting for WiFi "));
-  while (WiFi.status() != WL_CONNECTED)
-  {
-    Serial.print(F("."));
-    delay(500);
-  }
+int leakSensorCount()
+{
+  int n = 0;
+  for (int i = 0; i < LEAK_SENSOR_MAX; i++)
+    if (opParams.leakTopic[i][0] != (char)NULL)
+      n++;
+  return (n);
+}
 
-  randomSeed(micros());
+//   ***************************
+//   **  leakSensorsValid()   **
+//   ***************************
 
-  Serial.println(F(""));
-  Serial.print(F("WiFi connected to "));
-  Serial.println(WIFI_SSID);
-  Serial.print(F("IP address: "));
-  Serial.println(WiFi.localIP());
+// Every slot must be terminated and a used slot needs a trip payload
+bool leakSensorsValid(const struct Parameters &p)
+{
+  for (int i = 0; i < LEAK_SENSOR_MAX; i++)
+  {
+    if ((memchr(p.leakTopic[i], 0, LEAK_TOPIC_LEN) == NULL) || (memchr(p.leakPayload[i], 0, LEAK_PAYLOAD_LEN) == NULL))
+      return (false);
+    if ((p.leakTopic[i][0] != (char)NULL) && (p.leakPayload[i][0] == (char)NULL))
+      return (false);
+  }
+  return (true);
 }
 
-//   ************************
-//   ** OTA initialization **
-//   ************************
+//   ***************************
+//   **     paramsValid()     **
+//   ***************************
 
-void setup_OTA()
+// Whole-set check shared by the per-loop sanity check and setParams
+bool paramsValid(const struct Parameters &p)
 {
-  // Port defaults to 8266
-  // ArduinoOTA.setPort(8266);
+  return (!((p.idlePublishInterval < DEFAULT_MIN_PUBLISH_INTERVAL_MS) || (p.minPublishInterval < DEFAULT_SENSOR_READ_INTERVAL_MS)
+       || (p.sensorReadInterval < 3) || (p.sptPressureDrop <= (float).2) || (p.sptDemandWaterPercentDrop <= 5) || (p.sptDuration < 1)
+       || (p.fastReadInterval < 3) || (p.slowReadInterval < p.fastReadInterval) || (p.adaptiveSlopeThreshold <= 0)
+       || (p.publishMode > 1) || (p.sdtDeviation < (float).01) || (p.passiveStartHour > 23) || (p.passiveEndHour > 23)
+       || (p.sptAutoSchedule > 1) || (p.valveExerciseDays > 90) || (p.valveExerciseMode > 1)
+       || (p.sptThermalMode > 2) || (fabs(p.sptThermalCoeff) > 50) || (p.valveInstalled > 1) || (p.pressureInstalled > 1)
+       || (!leakSensorsValid(p))));
+}
 
-  // Hostname defaults to esp8266-[ChipID]
-  // ArduinoOTA.setHostname(DEVICE_NAME);
+//   ***************************
+//   **    formatParams()     **
+//   ***************************
 
-  // No authentication by default
-  // ArduinoOTA.setPassword("admin");
+// JSON report of valveState & opParams - used for REPORT_TOPIC and serial logging
+void formatParams(char *buf)
+{
+  sprintf(buf, "{\"valveState\": \"%d\", \"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", \"idlePublishInterval\": \"%d\", "
+               "\"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", \"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\", "
+               "\"adaptiveSampling\": \"%d\", \"fastReadInterval\": \"%d\", \"slowReadInterval\": \"%d\", \"adaptiveSlopeThreshold\": \"%.2f\", "
+               "\"publishMode\": \"%d\", \"sdtDeviation\": \"%.2f\", \"passiveStartHour\": \"%d\", \"passiveEndHour\": \"%d\", \"sptAutoSchedule\": \"%d\", "
+               "\"valveExerciseDays\": \"%d\", \"valveExerciseMode\": \"%d\", \"sptThermalMode\": \"%d\", \"sptThermalCoeff\": \"%.2f\", \"leakSensors\": \"%d\"}\n\n",
+          valveState, opParams.version, hasValve(), hasPressure(), opParams.idlePublishInterval, opParams.minPublishInterval,
+          opParams.sensorReadInterval, opParams.sptPressureDrop, opParams.sptDemandWaterPercentDrop, opParams.sptDuration,
+          opParams.adaptiveSampling, opParams.fastReadInterval, opParams.slowReadInterval, opParams.adaptiveSlopeThreshold,
+          opParams.publishMode, opParams.sdtDeviation, opParams.passiveStartHour, opParams.passiveEndHour, opParams.sptAutoSchedule,
+          opParams.valveExerciseDays, opParams.valveExerciseMode, opParams.sptThermalMode, opParams.sptThermalCoeff, leakSensorCount());
+}
 
-  // Password can be set with it's md5 value as well
-  // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
-  // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
+//   ***************************
+//   **    journalOpen()      **
+//   ***************************
 
-  ArduinoOTA.onStart([]() {
-    String type;
-    if (ArduinoOTA.getCommand() == U_FLASH)
+// Loads the journal header & rebuilds the RAM time index - recreates the file if missing or not a journal
+void journalOpen()
+{
+  File journalFileObj = LittleFS.open(F(JOURNAL_FILENAME), "r");
+  if (journalFileObj && (journalFileObj.size() == sizeof(journal) + JOURNAL_RECORDS * sizeof(JournalRecord)) &&
+      (journalFileObj.readBytes((char *)&journal, sizeof(journal)) == sizeof(journal)) && (journal.magic == JOURNAL_MAGIC))
+  {
+    struct JournalRecord rec;
+    for (unsigned int i = 0; i < JOURNAL_RECORDS / JOURNAL_INDEX_STRIDE; i++)
     {
-      type = "sketch";
-    }
-    else
-    { // U_FS
-      type = "filesystem";
+      journalFileObj.seek(sizeof(journal) + i * JOURNAL_INDEX_STRIDE * sizeof(rec));
+      journalIndex[i] = (journalFileObj.readBytes((char *)&rec, sizeof(rec)) == sizeof(rec)) ? rec.time : 0;
     }
+    journalFileObj.close();
+    Serial.printf("Event journal loaded: %d records\n", journal.count);
+    return;
+  }
+  journalFileObj.close();
+
+  Serial.println(F("No valid event journal detected - creating"));
+  memset(&journal, 0, sizeof(journal));
+  memset(journalIndex, 0, sizeof(journalIndex));
+  journal.magic = JOURNAL_MAGIC;
+  struct JournalRecord empty;
+  memset(&empty, 0, sizeof(empty));
+  journalFileObj = LittleFS.open(F(JOURNAL_FILENAME), "w");
+  journalFileObj.write((uint8_t *)&journal, sizeof(journal));
+  for (unsigned int i = 0; i < JOURNAL_RECORDS; i++)
+    journalFileObj.write((uint8_t *)&empty, sizeof(empty));
+  journalFileObj.close();
+}
 
-    // NOTE: if updating FS this would be the place to unmount FS using FS.end()
-    paramFileObj.close();
-    valveFileObj.close();
-    LittleFS.end();          //  <<<<<< This line required to prevent FS damage
-    mqttClient.disconnect(); // let broker know it is expected
+//   ***************************
+//   **    journalAppend()    **
+//   ***************************
 
-    Serial.println("Start updating " + type);
-  });
-  ArduinoOTA.onEnd([]() {
-    Serial.println(F("\nEnd"));
-  });
-  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
-  });
-  ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("Error[%u]: ", error);
-    if (error == OTA_AUTH_ERROR)
+void journalAppend(byte type, byte detail, float value, float value2)
+{
+  struct JournalRecord rec;
+  rec.time = now();
+  rec.type = type;
+  rec.detail = detail;
+  rec.value = value;
+  rec.value2 = value2;
+  if (journal.magic != JOURNAL_MAGIC)
+    return;
+  // only the fault types that can chatter every sample are rate limited - every SPT abort, leak trip... is kept.
+  // Each keeps its own last record so other events journaled in between do not defeat the limit.
+  struct JournalRecord *last = NULL;
+  if ((type == EVENT_VALVE_UNK) || (type == EVENT_PRESSURE_FAULT))
+  {
+    last = &journalRepeat[type == EVENT_PRESSURE_FAULT];
+    if ((detail == last->detail) && (last->time != 0) && (rec.time - last->time < JOURNAL_REPEAT_SECS))
+      return;
+  }
+  rec.seq = journal.seq++;
+
+  File journalFileObj = LittleFS.open(F(JOURNAL_FILENAME), "r+");
+  if (!journalFileObj)
+  {
+    Serial.println(F("Event journal open error"));
+    return;
+  }
+  journalFileObj.seek(sizeof(journal) + journal.head * sizeof(rec));
+  journalFileObj.write((uint8_t *)&rec, sizeof(rec));
+  if (journal.head % JOURNAL_INDEX_STRIDE == 0)
+    journalIndex[journal.head / JOURNAL_INDEX_STRIDE] = rec.time;
+  journal.head = (journal.head + 1) % JOURNAL_RECORDS;
+  if (journal.count < JOURNAL_RECORDS)
+    journal.count++;
+  journalFileObj.seek(0);
+  journalFileObj.write((uint8_t *)&journal, sizeof(journal));
+  journalFileObj.close();
+  if (last != NULL)
+    *last = rec;
+}
+
+//   ***************************
+//   **    journalQueryStart() **
+//   ***************************
+
+// Positions journalQuery at the first record at or after start using the RAM time index, so at most
+// JOURNAL_INDEX_STRIDE records are skipped by reading
+void journalQueryStart(uint32_t start, uint32_t end)
+{
+  uint16_t oldest = (journal.head + JOURNAL_RECORDS - journal.count) % JOURNAL_RECORDS;
+  journalQuery.next = 0;
+  uint32_t bestTime = 0;
+  for (unsigned int i = 0; i < JOURNAL_RECORDS / JOURNAL_INDEX_STRIDE; i++)
+  {
+    uint16_t logical = (i * JOURNAL_INDEX_STRIDE + JOURNAL_RECORDS - oldest) % JOURNAL_RECORDS;
+    if ((logical < journal.count) && (journalIndex[i] <= start) && (journalIndex[i] >= bestTime))
     {
-      Serial.println(F("Auth Failed"));
+      bestTime = journalIndex[i];
+      journalQuery.next = max(journalQuery.next, logical);
     }
-    else if (error == OTA_BEGIN_ERROR)
+  }
+  journalQuery.start = start;
+  journalQuery.end = end;
+  journalQuery.page = 0;
+  journalQuery.active = true;
+}
+
+//   ***************************
+//   **    journalQueryPage()  **
+//   ***************************
+
+// Publishes one page of the running query - called once per loop so a long range never stalls the loop
+void journalQueryPage()
+{
+  static const char *typeNames[] = {"", "boot", "valve", "valve_unknown", "pressure_fault", "spt_start", "spt_result", "spt_abort", "passive_score", "fixture_alert",
+                                     "valve_warning", "valve_exercise", "leak_trip",
+                                     "rtc_discarded"};
+  uint16_t oldest = (journal.head + JOURNAL_RECORDS - journal.count) % JOURNAL_RECORDS;
+  File journalFileObj = LittleFS.open(F(JOURNAL_FILENAME), "r");
+  int n = sprintf(msg, "{\"page\": \"%d\", \"events\": [", journalQuery.page);
+  int records = 0;
+  boolean done = true;
+  struct JournalRecord rec;
+  uint16_t pageStart = journalQuery.next;
+  while (journalQuery.next < journal.count)
+  {
+    journalFileObj.seek(sizeof(journal) + ((oldest + journalQuery.next) % JOURNAL_RECORDS) * sizeof(rec));
+    if (journalFileObj.readBytes((char *)&rec, sizeof(rec)) != sizeof(rec))
+      break;
+    if (rec.time > journalQuery.end)
+      break;
+    if (rec.time < journalQuery.start)
     {
-      Serial.println(F("Begin Failed"));
+      journalQuery.next++;
+      continue;
     }
-    else if (error == OTA_CONNECT_ERROR)
+    int len = snprintf(msg + n, JOURNAL_PAGE_MAX - n, "%s[\"%s\", \"%s\", \"%d\", \"%.2f\", \"%.2f\"]", (records > 0) ? ", " : "",
+                       myTZ.dateTime(rec.time, UTC_TIME, RFC3339).c_str(), (rec.type < sizeof(typeNames) / sizeof(typeNames[0])) ? typeNames[rec.type] : "unknown",
+                       rec.detail, rec.value, rec.value2);
+    if (len >= JOURNAL_PAGE_MAX - n) // record does not fit - it starts the next page
     {
-      Serial.println(F("Connect Failed"));
+      done = false;
+      break;
     }
-    else if (error == OTA_RECEIVE_ERROR)
+    n += len;
+    journalQuery.next++;
+    records++;
+  }
+  journalFileObj.close();
+  sprintf(msg + n, "], \"more\": \"%d\"}", done ? 0 : 1);
+  if (!mqttClient.publish(EVENTS_TOPIC, msg, false))
+  {
+    // stop rather than skip the records of the lost page
+    Serial.printf("%s MQTT publish failed: %s page %d, query ended\n", myTZ.dateTime("[H:i:s.v]").c_str(), EVENTS_TOPIC, journalQuery.page);
+    journalQuery.next = pageStart;
+    journalQuery.active = false;
+    return;
+  }
+  Serial.printf("%s MQTT SENT: %s page %d, %d records\n", myTZ.dateTime("[H:i:s.v]").c_str(), EVENTS_TOPIC, journalQuery.page, records);
+  journalQuery.page++;
+  journalQuery.active = !done;
+}
+
+//   ***************************
+//   **   adaptSampleRate()   **
+//   ***************************
+
+// Sets activeReadInterval from the slope (least squares) and standard deviation of the last ADAPTIVE_WINDOW samples.
+// A transient drops straight to fastReadInterval; once stable for ADAPTIVE_HOLD_MS the interval doubles each sample up to slowReadInterval.
+void adaptSampleRate(float psi, unsigned long sampleMs)
+{
+  if (opParams.adaptiveSampling != 1)
+  {
+    activeReadInterval = opParams.sensorReadInterval;
+    return;
+  }
+
+  adaptPsi[adaptCount % ADAPTIVE_WINDOW] = psi;
+  adaptMs[adaptCount % ADAPTIVE_WINDOW] = sampleMs;
+  adaptCount++;
+  if (adaptCount < ADAPTIVE_WINDOW)
+    return;
+
+  unsigned long oldestMs = adaptMs[adaptCount % ADAPTIVE_WINDOW];
+  float sumT = 0, sumP = 0, sumTT = 0, sumTP = 0, sumPP = 0;
+  for (int i = 0; i < ADAPTIVE_WINDOW; i++)
+  {
+    float t = (adaptMs[i] - oldestMs) / 1000.0; // seconds since oldest sample in window
+    sumT += t;
+    sumP += adaptPsi[i];
+    sumTT += t * t;
+    sumTP += t * adaptPsi[i];
+    sumPP += adaptPsi[i] * adaptPsi[i];
+  }
+  float denom = ADAPTIVE_WINDOW * sumTT - sumT * sumT;
+  float slope = (denom > 0) ? (ADAPTIVE_WINDOW * sumTP - sumT * sumP) / denom : 0;
+  float variance = (sumPP - sumP * sumP / ADAPTIVE_WINDOW) / (ADAPTIVE_WINDOW - 1);
+
+  if ((fabs(slope) > opParams.adaptiveSlopeThreshold) || (variance > ADAPTIVE_STDDEV_THRESHOLD_PSI * ADAPTIVE_STDDEV_THRESHOLD_PSI))
+  {
+    if (activeReadInterval != opParams.fastReadInterval)
+      Serial.printf("%s Adaptive sampling: transient (slope %.2f PSI/s) - read interval %d ms\n", myTZ.dateTime("[H:i:s.v]").c_str(), slope, opParams.fastReadInterval);
+    activeReadInterval = opParams.fastReadInterval;
+    lastTransient = sampleMs;
+  }
+  else if ((sampleMs - lastTransient > ADAPTIVE_HOLD_MS) && (activeReadInterval < opParams.slowReadInterval))
+  {
+    activeReadInterval *= 2;
+    if (activeReadInterval > opParams.slowReadInterval)
+      activeReadInterval = opParams.slowReadInterval;
+    if (activeReadInterval == opParams.slowReadInterval)
+      Serial.printf("%s Adaptive sampling: stable - read interval %d ms\n", myTZ.dateTime("[H:i:s.v]").c_str(), opParams.slowReadInterval);
+  }
+  if (activeReadInterval < opParams.fastReadInterval)   // bounds may have changed by command
+    activeReadInterval = opParams.fastReadInterval;
+}
+
+//   ***************************
+//   **   sdtProcessSample()  **
+//   ***************************
+
+// Swinging door trending compressor over the filtered per-sample pressure stream.  The door pivots on the last
+// archived point; each sample narrows the upper/lower slopes that keep every sample since then within
+// sdtDeviation.  When the door closes (lower > upper) the previous sample is archived and queued for publishing.
+void sdtProcessSample(float psi, unsigned long sampleMs)
+{
+  medianPressure = psi;
+
+  if ((!sdt.started) || ((unsigned long)(sampleMs - sdt.archMs) > opParams.idlePublishInterval)) // first point or heartbeat
+  {
+    sdt.started = true;
+    sdt.archMs = sampleMs;
+    sdt.archP = psi;
+    sdt.upper = INFINITY;
+    sdt.lower = -INFINITY;
+    sdt.pending = true;
+    sdt.pendingP = psi;
+  }
+  else
+  {
+    float dt = (sampleMs - sdt.archMs) / 1000.0;
+    if (dt > 0)
     {
-      Serial.println(F("Receive Failed"));
+      sdt.upper = min(sdt.upper, (psi + opParams.sdtDeviation - sdt.archP) / dt);
+      sdt.lower = max(sdt.lower, (psi - opParams.sdtDeviation - sdt.archP) / dt);
     }
-    else if (error == OTA_END_ERROR)
+    if (sdt.lower > sdt.upper) // door closed - archive previous sample and restart the door from it
     {
-      Serial.println(F("End Failed"));
+      sdt.archMs = sdt.prevMs;
+      sdt.archP = sdt.prevP;
+      sdt.pending = true;
+      sdt.pendingP = sdt.prevP;
+      dt = (sampleMs - sdt.archMs) / 1000.0;
+      sdt.upper = (dt > 0) ? (psi + opParams.sdtDeviation - sdt.archP) / dt : INFINITY;
+      sdt.lower = (dt > 0) ? (psi - opParams.sdtDeviation - sdt.archP) / dt : -INFINITY;
     }
-  });
-  ArduinoOTA.begin();
+  }
+  sdt.prevMs = sampleMs;
+  sdt.prevP = psi;
 }
 
-//   *************************
-//   **  applyValveState()  **
-//   *************************
+//   ***************************
+//   **   updateBaseline()    **
+//   ***************************
 
-// 0 = closed 1 = open
-boolean applyValveState(int desiredState, boolean writeFlag) // this routine uses the global char msg[], it does not set valveState global
+// Tracks static supply pressure: rises quickly, falls slowly, and holds while a draw is in progress
+void updateBaseline(float psi, unsigned long sampleMs)
 {
-  char val[3];
-  switch (desiredState)
+  if (pressureBaseline == 0)
   {
-  case 0:
-    digitalWrite(PIN_VALVE_OFF, HIGH);                       // turn on just enough to rotate valve
-    Serial.print(F("Closing valve..."));
-    valveNow = millis();
-    while (millis() - valveNow < VALVE_ROTATION_TIME_MS)
-      yield();
-    digitalWrite(PIN_VALVE_OFF, LOW);
-    Serial.println(F("valve is CLOSED (state=0)"));
-    sprintf(val, "%d", desiredState);
-    mqttClient.publish(VALVE_TOPIC, val, true);
-    Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TOPIC, val);
+    pressureBaseline = psi;
+    baselineMs = sampleMs;
+    return;
+  }
+  float dt = (float)(sampleMs - baselineMs);
+  baselineMs = sampleMs;
+  if (psi > pressureBaseline)
+    pressureBaseline += (psi - pressureBaseline) * dt / (BASELINE_RISE_TAU_MS + dt);
+  else if (pressureBaseline - psi < FIXTURE_START_DROP_PSI)
+    pressureBaseline += (psi - pressureBaseline) * dt / (BASELINE_FALL_TAU_MS + dt);
+}
 
-    if (writeFlag == true)
+//   ***************************
+//   **    passiveFinish()    **
+//   ***************************
+
+// Scores the quiet window just ended.  Micro-drops with recovery while no water is being used point to a slow leak
+// (e.g. a flapper letting a toilet tank refill); regularly spaced ones even more so.
+void passiveFinish()
+{
+  passive.active = false;
+  if (passive.quietMinutes < PASSIVE_MIN_QUIET_MINUTES)
+  {
+    mqttClient.publish(PASSIVE_LEAK_TOPIC, "not_valid", true);
+    Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PASSIVE_LEAK_TOPIC, "not_valid");
+    Serial.printf("Passive leak estimation: only %d quiet minutes - no score\n", passive.quietMinutes);
+    journalAppend(EVENT_PASSIVE_SCORE, 0, -1, passive.quietMinutes);
+    return;
+  }
+
+  float dropsPerHour = passive.drops / (passive.quietMinutes / 60.0);
+  float intervalCv = -1, regularity = 0;
+  if ((passive.intervals >= 3) && (passive.intervalMean > 0))
+  {
+    intervalCv = sqrt(passive.intervalM2 / (passive.intervals - 1)) / passive.intervalMean;
+    regularity = max(0.0f, 1.0f - intervalCv);
+  }
+  int score = (int)(100.0 * (1.0 - exp(-dropsPerHour / PASSIVE_RATE_SCALE)) * (0.5 + 0.5 * regularity) + 0.5);
+
+  sprintf(msg, "%d", score);
+  mqttClient.publish(PASSIVE_LEAK_TOPIC, msg, true);
+  journalAppend(EVENT_PASSIVE_SCORE, 0, score, passive.quietMinutes);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PASSIVE_LEAK_TOPIC, msg);
+
+  sprintf(msg, "{\"window_end\": \"%s\", \"suspicious\": \"%s\", \"quiet_minutes\": \"%d\", \"demand_minutes\": \"%d\", \"micro_drops\": \"%d\", "
+               "\"drops_per_hour\": \"%.2f\", \"mean_depth\": \"%.3f\", \"mean_recovery_secs\": \"%.1f\", \"interval_cv\": \"%.2f\", \"baseline_pressure\": \"%.2f\"}",
+          myTZ.dateTime(RFC3339).c_str(), (score >= PASSIVE_SUSPICIOUS_SCORE) ? "true" : "false", passive.quietMinutes, passive.demandMinutes, passive.drops,
+          dropsPerHour, (passive.drops > 0) ? passive.sumDepth / passive.drops : 0, (passive.drops > 0) ? passive.sumRecoverySecs / passive.drops : 0,
+          intervalCv, pressureBaseline);
+  mqttClient.publish(PASSIVE_LEAK_TOPIC"/attributes", msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PASSIVE_LEAK_TOPIC"/attributes", msg);
+}
+
+//   ******************************
+//   **  passiveProcessSample()  **
+//   ******************************
+
+// Passive leak estimation - runs only inside the passiveStartHour..passiveEndHour window with the valve open and no SPT.
+// Each minute is classed as demand or zero-demand; within zero-demand time, dips of PASSIVE_MICRO_DROP_PSI that recover are counted.
+void passiveProcessSample(float psi, unsigned long sampleMs)
+{
+  boolean inWindow = false;
+  if ((timeStatus() == timeSet) && (opParams.passiveStartHour != opParams.passiveEndHour))
+  {
+    unsigned int hour = myTZ.hour();
+    if (opParams.passiveStartHour < opParams.passiveEndHour)
+      inWindow = (hour >= opParams.passiveStartHour) && (hour < opParams.passiveEndHour);
+    else // window spans midnight
+      inWindow = (hour >= opParams.passiveStartHour) || (hour < opParams.passiveEndHour);
+  }
+  if (!inWindow)
+  {
+    if (passive.active)
+      passiveFinish();
+    return;
+  }
+  if ((!supplyOpen()) || (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0))
+    return; // supply is shut off - not a passive observation
+
+  if (!passive.active)
+  {
+    memset(&passive, 0, sizeof(passive));
+    passive.active = true;
+    passive.minuteStartMs = sampleMs;
+    passive.minuteMin = psi;
+    Serial.println(F("Passive leak estimation window started"));
+  }
+
+  float drop = pressureBaseline - psi;
+  passive.minuteMin = min(passive.minuteMin, psi);
+  if (sampleMs - passive.minuteStartMs >= 60000)
+  {
+    if (pressureBaseline - passive.minuteMin >= DEMAND_DROP_PSI)
+      passive.demandMinutes++;
+    else
+      passive.quietMinutes++;
+    passive.minuteStartMs = sampleMs;
+    passive.minuteMin = psi;
+  }
+
+  if (drop >= DEMAND_DROP_PSI)  // real water use - whatever dip was in progress is not a micro-drop
+  {
+    passive.inDrop = false;
+    return;
+  }
+  if (!passive.inDrop)
+  {
+    if (drop >= PASSIVE_MICRO_DROP_PSI)
+    {
+      passive.inDrop = true;
+      passive.dropStartMs = sampleMs;
+      passive.troughMs = sampleMs;
+      passive.troughDepth = drop;
+    }
+  }
+  else if (drop > passive.troughDepth)
+  {
+    passive.troughDepth = drop;
+    passive.troughMs = sampleMs;
+  }
+  else if (drop < PASSIVE_MICRO_DROP_PSI / 2) // recovered
+  {
+    passive.inDrop = false;
+    passive.drops++;
+    passive.sumDepth += passive.troughDepth;
+    passive.sumRecoverySecs += (sampleMs - passive.troughMs) / 1000.0;
+    if (passive.drops > 1)
+    {
+      float interval = (passive.dropStartMs - passive.lastDropMs) / 60000.0;
+      passive.intervals++;
+      float delta = interval - passive.intervalMean;
+      passive.intervalMean += delta / passive.intervals;
+      passive.intervalM2 += delta * (interval - passive.intervalMean);
+    }
+    passive.lastDropMs = passive.dropStartMs;
+  }
+}
+
+//   *****************************
+//   **  demandProcessSample()  **
+//   *****************************
+
+// Counts each new drop of DEMAND_DROP_PSI below the static baseline into demandHist[][] for the SPT scheduler
+void demandProcessSample(float psi)
+{
+  float drop = pressureBaseline - psi;
+  if (demandActive)
+  {
+    if (drop < DEMAND_DROP_PSI / 2)
+      demandActive = false;
+    return;
+  }
+  if ((drop < DEMAND_DROP_PSI) || (!supplyOpen()) || (timeStatus() != timeSet))
+    return;
+
+  demandActive = true;
+  byte *bin = &demandHist[myTZ.weekday() - 1][myTZ.hour()];
+  if (*bin == 255) // age the whole histogram so recent habits outweigh old ones
+  {
+    for (int d = 0; d < 7; d++)
+      for (int h = 0; h < 24; h++)
+        demandHist[d][h] >>= 1;
+  }
+  (*bin)++;
+  demandHistDirty = true;
+}
+
+//   ***************************
+//   **   saveDemandHist()    **
+//   ***************************
+
+// Written at most once an hour to spare the flash
+void saveDemandHist()
+{
+  File histFileObj = LittleFS.open(F(DEMAND_HIST_FILENAME), "w");
+  if (histFileObj.write((uint8_t *)demandHist, sizeof(demandHist)) == sizeof(demandHist))
+    demandHistDirty = false;
+  else
+    Serial.println(F("Demand histogram file write error"));
+  histFileObj.close();
+}
+
+//   ***************************
+//   **  fixturePublishCounts() **
+//   ***************************
+
+void fixturePublishCounts()
+{
+  int n = sprintf(msg, "{\"date\": \"%s\"", (fixture.countsDate[0] != (char)NULL) ? fixture.countsDate : myTZ.dateTime("Y-m-d").c_str());
+  for (unsigned int i = 0; i < FIXTURE_TYPES; i++)
+    n += sprintf(msg + n, ", \"%s\": \"%d\"", fixtureTemplates[i].name, fixture.dailyCounts[i]);
+  sprintf(msg + n, ", \"unknown\": \"%d\", \"draw_minutes\": \"%.1f\"}", fixture.dailyCounts[FIXTURE_TYPES], fixture.dailyMinutes);
+  mqttClient.publish(FIXTURE_COUNTS_TOPIC, msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), FIXTURE_COUNTS_TOPIC, msg);
+}
+
+//   ***************************
+//   **   fixtureClassify()   **
+//   ***************************
+
+// Returns the index of the closest template whose ranges contain the draw, or FIXTURE_TYPES if none match.
+// Closeness is measured from the centre of each range - log scale for duration since fixtures span seconds to hours.
+unsigned int fixtureClassify(float secs, float depth)
+{
+  unsigned int best = FIXTURE_TYPES;
+  float bestDistance = 0;
+  for (unsigned int i = 0; i < FIXTURE_TYPES; i++)
+  {
+    const FixtureTemplate &t = fixtureTemplates[i];
+    if ((secs < t.minSecs) || (secs > t.maxSecs) || (depth < t.minDepth) || (depth > t.maxDepth))
+      continue;
+    float d = fabs(log(secs) - (log(t.minSecs) + log(t.maxSecs)) / 2) / (log(t.maxSecs) - log(t.minSecs))
+            + fabs(depth - (t.minDepth + t.maxDepth) / 2) / (t.maxDepth - t.minDepth);
+    if ((best == FIXTURE_TYPES) || (d < bestDistance))
+    {
+      best = i;
+      bestDistance = d;
+    }
+  }
+  return best;
+}
+
+//   ***************************
+//   **   fixtureEndDraw()    **
+//   ***************************
+
+void fixtureEndDraw()
+{
+  fixture.inDraw = false;
+  unsigned long durationMs = fixture.recoveredMs - fixture.startMs;
+  if (durationMs < FIXTURE_MIN_DURATION_MS)
+    return;
+
+  float secs = durationMs / 1000.0;
+  float meanDrop = fixture.sumDrop / fixture.samples;
+  unsigned int type = fixtureClassify(secs, fixture.depth);
+  const char *name = (type < FIXTURE_TYPES) ? fixtureTemplates[type].name : "unknown";
+  fixture.dailyCounts[type]++;
+  fixture.dailyMinutes += secs / 60;
+
+  sprintf(msg, "{\"time\": \"%s\", \"fixture\": \"%s\", \"duration_secs\": \"%.1f\", \"depth\": \"%.2f\", \"mean_drop\": \"%.2f\"}",
+          myTZ.dateTime(RFC3339).c_str(), name, secs, fixture.depth, meanDrop);
+  mqttClient.publish(FIXTURE_EVENT_TOPIC, msg, false);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), FIXTURE_EVENT_TOPIC, msg);
+
+  // A toilet that refills on a short regular cycle with nothing else running is leaking through its flapper
+  if (strcmp(name, "toilet") == 0)
+  {
+    if ((fixture.lastToiletMs != 0) && (fixture.startMs - fixture.lastToiletMs < (unsigned long)FIXTURE_TOILET_REPEAT_MIN * 60000))
+      fixture.toiletRepeats++;
+    else
+      fixture.toiletRepeats = 1;
+    if (fixture.toiletRepeats == FIXTURE_TOILET_REPEAT_COUNT)
+    {
+      sprintf(msg, "{\"time\": \"%s\", \"alert\": \"toilet_repeat_refill\", \"refills\": \"%d\", \"last_interval_min\": \"%.1f\"}",
+              myTZ.dateTime(RFC3339).c_str(), fixture.toiletRepeats, (fixture.startMs - fixture.lastToiletMs) / 60000.0);
+      mqttClient.publish(FIXTURE_ALERT_TOPIC, msg, true);
+      journalAppend(EVENT_FIXTURE_ALERT, fixture.toiletRepeats, (fixture.startMs - fixture.lastToiletMs) / 60000.0, 0);
+      Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), FIXTURE_ALERT_TOPIC, msg);
+    }
+    fixture.lastToiletMs = fixture.startMs;
+  }
+  else
+    fixture.toiletRepeats = 0;
+}
+
+//   ******************************
+//   **  fixtureProcessSample()  **
+//   ******************************
+
+// Streaming draw segmenter - a draw runs from the first sample FIXTURE_START_DROP_PSI below the static baseline
+// until pressure has stayed within FIXTURE_END_DROP_PSI for FIXTURE_END_HOLD_MS
+void fixtureProcessSample(float psi, unsigned long sampleMs)
+{
+  if (timeStatus() == timeSet)
+  {
+    int today = myTZ.dayOfYear();
+    if (fixture.countsDay != today)
+    {
+      if (fixture.countsDay != -1)
+        fixturePublishCounts();
+      memset(fixture.dailyCounts, 0, sizeof(fixture.dailyCounts));
+      fixture.dailyMinutes = 0;
+      fixture.countsDay = today;
+      strcpy(fixture.countsDate, myTZ.dateTime("Y-m-d").c_str());
+    }
+  }
+  if ((!supplyOpen()) || (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0))
+  {
+    fixture.inDraw = false;  // supply is shut off - pressure shape is not a draw
+    return;
+  }
+
+  float drop = pressureBaseline - psi;
+  if (!fixture.inDraw)
+  {
+    if (drop >= FIXTURE_START_DROP_PSI)
+    {
+      fixture.inDraw = true;
+      fixture.startMs = sampleMs;
+      fixture.recoveredMs = 0;
+      fixture.depth = drop;
+      fixture.sumDrop = 0;
+      fixture.samples = 0;
+    }
+    else
+      return;
+  }
+  if (sampleMs - fixture.startMs > FIXTURE_MAX_DRAW_MS)
+  {
+    Serial.println(F("Supply pressure step detected - static baseline reset"));
+    fixture.inDraw = false;
+    pressureBaseline = psi;
+    return;
+  }
+  fixture.depth = max(fixture.depth, drop);
+  fixture.sumDrop += drop;
+  fixture.samples++;
+  if (drop < FIXTURE_END_DROP_PSI)
+  {
+    if (fixture.recoveredMs == 0)
+      fixture.recoveredMs = sampleMs;
+    else if (sampleMs - fixture.recoveredMs >= FIXTURE_END_HOLD_MS)
+      fixtureEndDraw();
+  }
+  else
+    fixture.recoveredMs = 0;
+}
+
+//   ***************************
+//   **     readSensor()      **
+//   ***************************
+
+// One I2C read of the pressure sensor.  Returns the sensor status (0 = fresh data in psiTminus0 & temperature,
+// 1-3 = sensor busy/stale/fault) or 0xFF if the sensor did not answer.
+byte readSensor()
+{
+  Wire.requestFrom(I2C_ADDR, 4); // request 4 bytes  - if optional 3rd argument false = don't share i2c bus
+  int n = Wire.available();
+  if (n != 4)
+    return (0xFF);
+
+  uint16_t rawP; // pressure data from sensor
+  uint16_t rawT; // temperature data from sensor
+
+  rawP = (uint16_t)Wire.read(); // upper 8 bits
+  rawP <<= 8;
+  rawP |= (uint16_t)Wire.read(); // lower 8 bits
+  rawT = (uint16_t)Wire.read();  // upper 8 bits
+  rawT <<= 8;
+  rawT |= (uint16_t)Wire.read(); // lower 8 bits
+
+  byte status = rawP >> 14;  // The status is 0, 1, 2 or 3
+  rawP &= 0x3FFF;            // keep 14 bits, remove status bits
+
+  rawT >>= 5; // the lowest 5 bits are not used
+
+  psiTminus0 = ((rawP - 1000.0) / (15000.0 - 1000.0)) * MAX_PRESSURE;
+  temperature = ((rawT - 512.0) / (1075.0 - 512.0)) * 55.0;
+  sensorTempC = temperature;
+  return (status);
+}
+
+struct SptThermal                // least-squares sums of the pressure & temperature traces of the running SPT
+{
+  boolean active;
+  unsigned long startMs, lastMs;
+  float p0, t0;                   // first sample - sums are taken relative to it to keep precision
+  unsigned long n;
+  double sumX, sumXX, sumP, sumXP, sumT, sumXT;
+};
+
+struct SptThermalHist            // pressure & temperature rates of past valid tests for fitting the coefficient
+{
+  uint32_t magic;
+  uint16_t count;
+  float pressRate[SPT_THERMAL_HISTORY];  // PSI/min
+  float tempRate[SPT_THERMAL_HISTORY];   // C/min
+};
+
+struct SptThermal sptThermal;
+struct SptThermalHist sptThermalHist;
+
+//   ***************************
+//   **  sptThermalSample()   **
+//   ***************************
+
+// Accumulates the SPT pressure & temperature traces - time in minutes since the test began
+void sptThermalSample(float psi, float tempC, unsigned long sampleMs)
+{
+  if ((!sptThermal.active) || (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) != 0))
+    return;
+  if (sptThermal.n == 0)
+  {
+    sptThermal.startMs = sampleMs;
+    sptThermal.p0 = psi;
+    sptThermal.t0 = tempC;
+  }
+  sptThermal.lastMs = sampleMs;
+  double x = (sampleMs - sptThermal.startMs) / 60000.0;
+  double p = psi - sptThermal.p0;
+  double t = tempC - sptThermal.t0;
+  sptThermal.n++;
+  sptThermal.sumX += x;
+  sptThermal.sumXX += x * x;
+  sptThermal.sumP += p;
+  sptThermal.sumXP += x * p;
+  sptThermal.sumT += t;
+  sptThermal.sumXT += x * t;
+}
+
+//   *******************************
+//   **  processPressureSample()  **
+//   *******************************
+
+// Called for every successful sensor read with the raw pressure
+void processPressureSample(float psi, unsigned long sampleMs)
+{
+  sampleRaw[sampleCount % 3] = psi;
+  sampleCount++;
+  if (sampleCount >= 3) // MEDIAN of last three readings filters glitches
+    filteredPressure = max(min(sampleRaw[0], sampleRaw[1]), min(max(sampleRaw[0], sampleRaw[1]), sampleRaw[2]));
+  else
+    filteredPressure = psi;
+
+  adaptSampleRate(psi, sampleMs);
+  updateBaseline(filteredPressure, sampleMs);
+  if (opParams.publishMode == 1)
+    sdtProcessSample(filteredPressure, sampleMs);
+  passiveProcessSample(filteredPressure, sampleMs);
+  demandProcessSample(filteredPressure);
+  fixtureProcessSample(filteredPressure, sampleMs);
+  if constexpr (HAS_SPT)
+    sptThermalSample(filteredPressure, sensorTempC, sampleMs);
+}
+
+//   ***************************
+//   **  WiFi initialization  **
+//   ***************************
+
+void setup_wifi()
+{
+  delay(10); // let Serial comm stream start before using it
+
+  // We start by connecting to a WiFi network
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setHostname(DEVICE_NAME);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+
+  Serial.print(F("\nWaiting for WiFi "));
+  while (WiFi.status() != WL_CONNECTED)
+  {
+    Serial.print(F("."));
+    delay(500);
+  }
+
+  randomSeed(micros());
+
+  Serial.println(F(""));
+  Serial.print(F("WiFi connected to "));
+  Serial.println(WIFI_SSID);
+  Serial.print(F("IP address: "));
+  Serial.println(WiFi.localIP());
+}
+
+//   ************************
+//   **    otaProtect()    **
+//   ************************
+
+// Minimal leak protection while ArduinoOTA writes flash - called from the progress callback between chunks.
+// Samples pressure, closes the valve on a sustained burst-sized drop and times the close relay without blocking the transfer.
+void otaProtect()
+{
+  unsigned long nowMs = millis();
+  if constexpr (HAS_VALVE)
+  {
+    if ((ota.valveCloseAt != 0) && (nowMs - ota.valveCloseAt >= VALVE_ROTATION_TIME_MS))
+    {
+      digitalWrite(PIN_VALVE_OFF, LOW);
+      ota.valveCloseAt = 0;
+      Serial.println(F("\nOTA protection: valve is CLOSED (state=0)"));
+    }
+  }
+  if constexpr (HAS_VALVE && HAS_PRESSURE)
+  {
+    if ((!hasValve()) || (!hasPressure()) || (valveState != OPEN_VALVE) || (nowMs - ota.lastReadMs < OTA_PROTECT_READ_INTERVAL_MS))
+      return;
+    ota.lastReadMs = nowMs;
+    if (readSensor() != 0)
+      return;
+
+    ota.raw[ota.count % 3] = psiTminus0;
+    ota.count++;
+    if (ota.count < 3)
+      return;
+    float psi = max(min(ota.raw[0], ota.raw[1]), min(max(ota.raw[0], ota.raw[1]), ota.raw[2]));
+    if (ota.startPressure <= 0)
+      ota.startPressure = psi;
+
+    if (psi < ota.startPressure * (1 - OTA_BURST_DROP_PERCENT / 100.0))
+    {
+      if (ota.burstSinceMs == 0)
+        ota.burstSinceMs = nowMs;
+      else if (nowMs - ota.burstSinceMs >= OTA_BURST_HOLD_MS)
+      {
+        Serial.printf("\nOTA protection: burst detected (%.2f PSI, was %.2f) - closing valve\n", psi, ota.startPressure);
+        digitalWrite(PIN_VALVE_ON, LOW);             // never energize both relays
+        digitalWrite(PIN_VALVE_OFF, HIGH);
+        ota.valveCloseAt = max(nowMs, 1UL);
+        ota.valveClosed = true;
+        valveState = CLOSE_VALVE;                    // actual state is synced from the indicators after the update
+      }
+    }
+    else
+      ota.burstSinceMs = 0;
+  }
+}
+
+//   ************************
+//   **   otaProtectEnd()  **
+//   ************************
+
+// Update finished or failed - let a protection close finish rotating before the reboot or resume
+void otaProtectEnd()
+{
+  if constexpr (HAS_VALVE)
+  {
+    while (ota.valveCloseAt != 0)
+    {
+      otaProtect();
+      yield();
+    }
+  }
+}
+
+//   ************************
+//   **  otaProtectRecord() **
+//   ************************
+
+// A failed update leaves the sketch running - a protection close is saved & journaled like any other valve move.
+// onStart dropped the MQTT connection, so the retained VALVE_TOPIC is corrected by postConnectSync() as it reconnects.
+void otaProtectRecord()
+{
+  if (!ota.valveClosed)
+    return;
+  valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
+  if (valveFileObj.write((uint8_t *)&valveState, sizeof(valveState)) > 0)
+    Serial.println(F("Valve state saved"));
+  else
+    Serial.println(F("Valve file update error"));
+  valveFileObj.close();
+  journalAppend(EVENT_VALVE, CLOSE_VALVE, -1, 1);
+  if (mqttClient.connected())
+    mqttClient.publish(VALVE_TOPIC, "0", true);
+  ota.valveClosed = false;
+}
+
+//   ************************
+//   ** OTA initialization **
+//   ************************
+
+void valveMoveAbort(); // defined with the valve exercise
+
+void setup_OTA()
+{
+  // Port defaults to 8266
+  // ArduinoOTA.setPort(8266);
+
+  // Hostname defaults to esp8266-[ChipID]
+  // ArduinoOTA.setHostname(DEVICE_NAME);
+
+  // No authentication by default
+  // ArduinoOTA.setPassword("admin");
+
+  // Password can be set with it's md5 value as well
+  // MD5(admin) = 21232f297a57a5a743894a0e4a801fc3
+  // ArduinoOTA.setPasswordHash("21232f297a57a5a743894a0e4a801fc3");
+
+  ArduinoOTA.onStart([]() {
+    valveMoveAbort(); // a relay left energized would stay on for the whole flash
+    String type;
+    if (ArduinoOTA.getCommand() == U_FLASH)
+    {
+      type = "sketch";
+    }
+    else
+    { // U_FS
+      type = "filesystem";
+    }
+
+    // NOTE: if updating FS this would be the place to unmount FS using FS.end()
+    paramFileObj.close();
+    valveFileObj.close();
+    LittleFS.end();          //  <<<<<< This line required to prevent FS damage
+    mqttClient.disconnect(); // let broker know it is expected
+
+    memset(&ota, 0, sizeof(ota));
+    ota.startPressure = filteredPressure;  // burst reference - protection keeps running between flash chunks
+    Serial.println("Start updating " + type);
+  });
+  ArduinoOTA.onEnd([]() {
+    otaProtectEnd();
+    Serial.println(F("\nEnd"));
+  });
+  ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
+    otaProtect();
+    Serial.printf("Progress: %u%%\r", (progress / (total / 100)));
+  });
+  ArduinoOTA.onError([](ota_error_t error) {
+    otaProtectEnd();
+    LittleFS.begin();        // sketch keeps running after a failed update - remount what onStart unmounted
+    otaProtectRecord();
+    Serial.printf("Error[%u]: ", error);
+    if (error == OTA_AUTH_ERROR)
+    {
+      Serial.println(F("Auth Failed"));
+    }
+    else if (error == OTA_BEGIN_ERROR)
+    {
+      Serial.println(F("Begin Failed"));
+    }
+    else if (error == OTA_CONNECT_ERROR)
+    {
+      Serial.println(F("Connect Failed"));
+    }
+    else if (error == OTA_RECEIVE_ERROR)
+    {
+      Serial.println(F("Receive Failed"));
+    }
+    else if (error == OTA_END_ERROR)
+    {
+      Serial.println(F("End Failed"));
+    }
+  });
+  ArduinoOTA.begin();
+}
+
+//   ***************************
+//   **  valveHealthSave()    **
+//   ***************************
+
+void valveHealthSave()
+{
+  File healthFileObj = LittleFS.open(F(VALVE_HEALTH_FILENAME), "w");
+  if (healthFileObj.write((uint8_t *)&valveHealth, sizeof(valveHealth)) != sizeof(valveHealth))
+    Serial.println(F("Valve health file write error"));
+  healthFileObj.close();
+}
+
+//   ***************************
+//   **  valveSeriesTrend()   **
+//   ***************************
+
+// Mean of the most recent samples and the least-squares slope (msecs per actuation) over the trend window
+void valveSeriesTrend(int series, float *recent, float *slope)
+{
+  unsigned int n = min((unsigned int)valveHealth.count[series], (unsigned int)VALVE_TREND_WINDOW);
+  unsigned int r = min(n, (unsigned int)VALVE_TREND_RECENT);
+  float sumX = 0, sumY = 0, sumXY = 0, sumXX = 0;
+  *recent = 0;
+  for (unsigned int i = 0; i < n; i++)           // i = 0 is the oldest sample in the window
+  {
+    float y = valveHealth.travel[series][(valveHealth.count[series] - n + i) % VALVE_TREND_WINDOW];
+    sumX += i;
+    sumY += y;
+    sumXY += i * y;
+    sumXX += (float)i * i;
+    if (i >= n - r)
+      *recent += y / r;
+  }
+  float den = n * sumXX - sumX * sumX;
+  *slope = (den > 0) ? (n * sumXY - sumX * sumY) / den : 0;
+}
+
+//   ***************************
+//   **  valveHealthPublish() **
+//   ***************************
+
+// Publishes the trend of every series and returns the first degraded series (-1 if healthy)
+int valveHealthPublish()
+{
+  static const char *seriesNames[3] = {"close", "open", "breakaway"};
+  int degraded = -1;
+  int n = sprintf(msg, "{");
+  for (int series = 0; series < 3; series++)
+  {
+    float recent, slope;
+    valveSeriesTrend(series, &recent, &slope);
+    long toStall = -1;                              // actuations until the trend reaches VALVE_ROTATION_TIME_MS - -1 if not rising
+    if ((valveHealth.count[series] >= VALVE_TREND_BASELINE) && (slope > 0))
+      toStall = (long)max((VALVE_ROTATION_TIME_MS - recent) / slope, 0.0f);
+    if ((valveHealth.count[series] >= VALVE_TREND_BASELINE) && (degraded < 0) &&
+        ((recent > valveHealth.baseline[series] * (1 + VALVE_TRAVEL_WARN_PERCENT / 100.0)) ||
+         ((toStall >= 0) && (toStall < VALVE_STALL_WARN_ACTUATIONS))))
+      degraded = series;
+    n += sprintf(msg + n, "%s\"%s_count\": \"%u\", \"%s_baseline_ms\": \"%.0f\", \"%s_recent_ms\": \"%.0f\", "
+                          "\"%s_slope_ms\": \"%.1f\", \"%s_to_stall\": \"%ld\"",
+                 (series > 0) ? ", " : "", seriesNames[series], valveHealth.count[series], seriesNames[series], valveHealth.baseline[series],
+                 seriesNames[series], recent, seriesNames[series], slope, seriesNames[series], toStall);
+  }
+  sprintf(msg + n, ", \"close_stalls\": \"%u\", \"open_stalls\": \"%u\", \"last_exercise\": \"%s\"}",
+          valveHealth.stalls[0], valveHealth.stalls[1],
+          (valveHealth.lastExercise != 0) ? myTZ.dateTime((time_t)valveHealth.lastExercise, UTC_TIME, RFC3339).c_str() : "never");
+  mqttClient.publish(VALVE_HEALTH_TOPIC, msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_HEALTH_TOPIC, msg);
+  return (degraded);
+}
+
+//   ***************************
+//   **   valveWarning()      **
+//   ***************************
+
+void valveWarning(int series, float recentMs)
+{
+  sprintf(msg, "{\"time\": \"%s\", \"series\": \"%d\", \"recent_ms\": \"%.0f\", \"baseline_ms\": \"%.0f\"}",
+          myTZ.dateTime(RFC3339).c_str(), series, recentMs, valveHealth.baseline[series]);
+  mqttClient.publish(VALVE_WARNING_TOPIC, msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_WARNING_TOPIC, msg);
+  journalAppend(EVENT_VALVE_WARNING, series, recentMs, valveHealth.baseline[series]);
+}
+
+//   ***************************
+//   **  valveTravelRecord()  **
+//   ***************************
+
+// Adds one measured actuation to the trend - travelMs -1 means the valve never reached the far end stop, -2 no travel
+// was measured (partial exercise).  Breakaway has its own series - pass -1 if the valve did not start at the open stop.
+void valveTravelRecord(int direction, long travelMs, long breakawayMs)
+{
+  int series[2] = {direction, VALVE_SERIES_BREAKAWAY};
+  long sample[2] = {travelMs, breakawayMs};
+  for (int i = 0; i < 2; i++)
+  {
+    if (sample[i] < 0)
+      continue;
+    int k = series[i];
+    valveHealth.travel[k][valveHealth.count[k] % VALVE_TREND_WINDOW] = (uint16_t)min(sample[i], 65535L);
+    valveHealth.count[k]++;
+    if (valveHealth.count[k] <= VALVE_TREND_BASELINE)         // still learning the healthy travel time
+      valveHealth.baseline[k] += (sample[i] - valveHealth.baseline[k]) / valveHealth.count[k];
+  }
+  if (travelMs == -1)
+    valveHealth.stalls[direction]++;
+  valveHealthSave();
+
+  int degraded = valveHealthPublish();
+  if (travelMs == -1)
+    valveWarning(direction, -1);
+  else if (degraded >= 0)
+  {
+    float recent, slope;
+    valveSeriesTrend(degraded, &recent, &slope);
+    valveWarning(degraded, recent);
+  }
+}
+
+//   *************************
+//   **  applyValveState()  **
+//   *************************
+
+// 0 = closed 1 = open
+boolean applyValveState(int desiredState, boolean writeFlag) // this routine uses the global char msg[], it does not set valveState global
+{
+  char val[3];
+  boolean startAtStop;  // valve was resting at the opposite end stop, so this actuation is a travel time sample
+  switch (desiredState)
+  {
+  case 0:
+    startAtStop = (digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW);
+    digitalWrite(PIN_VALVE_OFF, HIGH);                       // turn on just enough to rotate valve
+    Serial.print(F("Closing valve..."));
+    valveNow = millis();
+    valveEnergizedAt = valveNow;
+    valveConfirmedAt = 0;
+    valveDepartedAt = 0;
+    while (millis() - valveNow < VALVE_ROTATION_TIME_MS)
+    {
+      if (startAtStop && (valveDepartedAt == 0) && (digitalRead(PIN_VALVE_ON_INDICATOR) == LOW))
+        valveDepartedAt = millis();                          // left the open end stop
+      if ((valveConfirmedAt == 0) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH))
+        valveConfirmedAt = millis();                         // first time the closed end stop is seen
+      yield();
+    }
+    digitalWrite(PIN_VALVE_OFF, LOW);
+    Serial.println(F("valve is CLOSED (state=0)"));
+    sprintf(val, "%d", desiredState);
+    mqttClient.publish(VALVE_TOPIC, val, true);
+    valvePublishedAt = millis();
+    if (writeFlag == true)                                   // saved moves only - a half-open re-drive repeats every sync, SPT moves have their own events
+      journalAppend(EVENT_VALVE, desiredState, (valveConfirmedAt != 0) ? (float)(valveConfirmedAt - valveEnergizedAt) : -1, 0);
+    Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TOPIC, val);
+    if (startAtStop)                                         // only a move from end stop to end stop is a travel time sample
+      valveTravelRecord(VALVE_SERIES_CLOSE, ((valveDepartedAt != 0) && (valveConfirmedAt != 0)) ? (long)(valveConfirmedAt - valveDepartedAt) : -1,
+                        (valveDepartedAt != 0) ? (long)(valveDepartedAt - valveEnergizedAt) : -1);
+
+    if (writeFlag == true)
     {
       valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
       if (valveFileObj.write((uint8_t *)&desiredState, sizeof(desiredState)) > 0)
@@ -261,39 +1735,383 @@ boolean applyValveState(int desiredState, boolean writeFlag) // this routine use
     return (true);
     break;
   case 1:
+    startAtStop = (digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH) && (digitalRead(PIN_VALVE_ON_INDICATOR) == LOW);
     digitalWrite(PIN_VALVE_ON, HIGH);                        // turn on just enough to rotate valve
     Serial.print(F("Opening valve..."));
     valveNow = millis();
+    valveEnergizedAt = valveNow;
+    valveConfirmedAt = 0;
+    valveDepartedAt = 0;
     while (millis() - valveNow < VALVE_ROTATION_TIME_MS)
+    {
+      if (startAtStop && (valveDepartedAt == 0) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW))
+        valveDepartedAt = millis();                          // left the closed end stop
+      if ((valveConfirmedAt == 0) && (digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH))
+        valveConfirmedAt = millis();                         // first time the open end stop is seen
       yield();
+    }
     digitalWrite(PIN_VALVE_ON, LOW);
     Serial.println(F("valve is OPEN (state=1)"));
     sprintf(val, "%d", desiredState);
     mqttClient.publish(VALVE_TOPIC, val, true);
+    valvePublishedAt = millis();
+    if (writeFlag == true)                                   // saved moves only - a half-open re-drive repeats every sync, SPT moves have their own events
+      journalAppend(EVENT_VALVE, desiredState, (valveConfirmedAt != 0) ? (float)(valveConfirmedAt - valveEnergizedAt) : -1, 0);
     Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TOPIC, val);
+    if (startAtStop)
+      valveTravelRecord(VALVE_SERIES_OPEN, ((valveDepartedAt != 0) && (valveConfirmedAt != 0)) ? (long)(valveConfirmedAt - valveDepartedAt) : -1, -1);
+
+    if (writeFlag == true)
+    {
+      valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
+      if (valveFileObj.write((uint8_t *)&desiredState, sizeof(desiredState)) > 0)
+        Serial.println(F("Valve state saved"));
+      else
+        Serial.println(F("Valve file update error"));
+      valveFileObj.close();
+    }
+    return (true);
+    break;
+  default:
+    Serial.println(F("Invalid valveState requested"));
+    return (false);
+  }
+}
+
+//   ***************************
+//   **  valveTracePublish()  **
+//   ***************************
+
+// Publishes the stage timestamps of a traced valveState command (relative to MQTT receipt) and
+// the rolling p50/p95/max of receipt-to-indicator latency per direction
+void valveTracePublish(int state)
+{
+  long energizeMs = (long)(valveEnergizedAt - valveTrace.recvMs);
+  long confirmMs = (valveConfirmedAt != 0) ? (long)(valveConfirmedAt - valveTrace.recvMs) : -1;
+  long publishMs = (long)(valvePublishedAt - valveTrace.recvMs);
+
+  if (confirmMs >= 0)
+  {
+    valveTraceLatency[state][valveTraceCount[state] % VALVE_TRACE_WINDOW] = confirmMs;
+    valveTraceCount[state]++;
+  }
+  else
+    valveTraceUnconfirmed[state]++;
+
+  sprintf(msg, "{\"id\": \"%s\", \"state\": \"%d\", \"energize_ms\": \"%ld\", \"confirm_ms\": \"%ld\", \"publish_ms\": \"%ld\"}",
+          valveTrace.id, state, energizeMs, confirmMs, publishMs);
+  mqttClient.publish(VALVE_TRACE_TOPIC, msg, false);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TRACE_TOPIC, msg);
+
+  // Rolling statistics - nearest-rank percentiles over the last VALVE_TRACE_WINDOW confirmed commands
+  unsigned long p50[2], p95[2], maxLatency[2];
+  for (int dir = 0; dir < 2; dir++)
+  {
+    unsigned long sorted[VALVE_TRACE_WINDOW];
+    unsigned int n = (valveTraceCount[dir] < VALVE_TRACE_WINDOW) ? valveTraceCount[dir] : VALVE_TRACE_WINDOW;
+    for (unsigned int i = 0; i < n; i++)           // insertion sort - window is tiny
+    {
+      unsigned long v = valveTraceLatency[dir][i];
+      int j = i - 1;
+      while ((j >= 0) && (sorted[j] > v))
+      {
+        sorted[j + 1] = sorted[j];
+        j--;
+      }
+      sorted[j + 1] = v;
+    }
+    p50[dir] = (n > 0) ? sorted[(n * 50 + 99) / 100 - 1] : 0;
+    p95[dir] = (n > 0) ? sorted[(n * 95 + 99) / 100 - 1] : 0;
+    maxLatency[dir] = (n > 0) ? sorted[n - 1] : 0;
+  }
+  sprintf(msg, "{\"close_count\": \"%u\", \"close_p50_ms\": \"%lu\", \"close_p95_ms\": \"%lu\", \"close_max_ms\": \"%lu\", \"close_unconfirmed\": \"%u\", "
+               "\"open_count\": \"%u\", \"open_p50_ms\": \"%lu\", \"open_p95_ms\": \"%lu\", \"open_max_ms\": \"%lu\", \"open_unconfirmed\": \"%u\"}",
+          valveTraceCount[0], p50[0], p95[0], maxLatency[0], valveTraceUnconfirmed[0],
+          valveTraceCount[1], p50[1], p95[1], maxLatency[1], valveTraceUnconfirmed[1]);
+  mqttClient.publish(VALVE_TRACE_TOPIC"/stats", msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TRACE_TOPIC"/stats", msg);
+}
+
+//   ***************************
+//   **  valveExerciseStart() **
+//   ***************************
+
+// Begins a close & reopen of an open valve - loop() drives it through valveExerciseRun() so sampling never stops
+boolean valveExerciseStart()
+{
+  if ((!hasValve()) || (valveExercise.stage != 0) || (valveState != OPEN_VALVE) || (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0) ||
+      (digitalRead(PIN_VALVE_ON_INDICATOR) != HIGH))
+  {
+    Serial.println(F("Valve exercise not started - valve must be resting open with no SPT in process"));
+    return (false);
+  }
+  memset(&valveExercise, 0, sizeof(valveExercise));
+  valveExercise.startPressure = filteredPressure;
+  valveExercise.stage = 1;
+  valveExercise.stageAt = millis();
+  digitalWrite(PIN_VALVE_OFF, HIGH);
+  Serial.printf("%s Valve exercise started (%s)\n", myTZ.dateTime("[H:i:s.v]").c_str(), (opParams.valveExerciseMode == 1) ? "full" : "partial");
+  return (true);
+}
+
+//   ***************************
+//   **  valveExerciseAbort() **
+//   ***************************
+
+// Releases both relays so a valveState command or SPT can take over - the caller drives the valve to its new state,
+// so the relay contacts are given VALVE_RELAY_DEADTIME_MS to open before returning
+void valveExerciseAbort()
+{
+  if (valveExercise.stage == 0)
+    return;
+  digitalWrite(PIN_VALVE_OFF, LOW);
+  digitalWrite(PIN_VALVE_ON, LOW);
+  delay(VALVE_RELAY_DEADTIME_MS);
+  valveExercise.stage = 0;
+  Serial.println(F("Valve exercise cancelled"));
+}
 
-    if (writeFlag == true)
+//   ***************************
+//   **  valveExerciseRun()   **
+//   ***************************
+
+// One step of the exercise - reverses at once on water demand, after VALVE_EXERCISE_PARTIAL_MS of travel in
+// partial mode, or at the closed stop in full mode.  Travel times go into the same trend as commanded moves.
+void valveExerciseRun()
+{
+  unsigned long nowMs = millis();
+  if (valveExercise.stage == 1)
+  {
+    if ((valveExercise.departedAt == 0) && (digitalRead(PIN_VALVE_ON_INDICATOR) == LOW))
+      valveExercise.departedAt = nowMs;
+    if ((valveExercise.arrivedAt == 0) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH))
+      valveExercise.arrivedAt = nowMs;
+
+    boolean reverse = (nowMs - valveExercise.stageAt >= VALVE_ROTATION_TIME_MS);
+    if (hasPressure() && (valveExercise.startPressure - filteredPressure > DEMAND_DROP_PSI))
     {
-      valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
-      if (valveFileObj.write((uint8_t *)&desiredState, sizeof(desiredState)) > 0)
-        Serial.println(F("Valve state saved"));
-      else
-        Serial.println(F("Valve file update error"));
-      valveFileObj.close();
+      valveExercise.demandAbort = true;
+      reverse = true;
     }
-    return (true);
-    break;
-  default:
-    Serial.println(F("Invalid valveState requested"));
+    if (opParams.valveExerciseMode == 1)
+      reverse |= (valveExercise.arrivedAt != 0);
+    else
+      reverse |= ((valveExercise.departedAt != 0) && (nowMs - valveExercise.departedAt >= VALVE_EXERCISE_PARTIAL_MS));
+    if (!reverse)
+      return;
+
+    digitalWrite(PIN_VALVE_OFF, LOW);
+    valveExercise.breakawayMs = (valveExercise.departedAt != 0) ? valveExercise.departedAt - valveExercise.stageAt : 0;
+    if ((opParams.valveExerciseMode == 1) && (!valveExercise.demandAbort))
+      valveTravelRecord(VALVE_SERIES_CLOSE, (valveExercise.arrivedAt != 0) ? (long)(valveExercise.arrivedAt - valveExercise.departedAt) : -1,
+                        (valveExercise.departedAt != 0) ? (long)valveExercise.breakawayMs : -1);
+    else if (valveExercise.departedAt != 0)
+      valveTravelRecord(VALVE_SERIES_BREAKAWAY, -2, (long)valveExercise.breakawayMs);  // no full travel to record
+    else if (!valveExercise.demandAbort)
+      valveWarning(VALVE_SERIES_BREAKAWAY, -1);    // never left the open stop - seized
+
+    valveExercise.stage = 2;                       // the close relay must open before the open relay is energized
+    valveExercise.stageAt = millis();
+    return;
+  }
+
+  if (valveExercise.stage == 2)
+  {
+    if (nowMs - valveExercise.stageAt < VALVE_RELAY_DEADTIME_MS)
+      return;
+    valveExercise.stage = 3;
+    valveExercise.stageAt = millis();
+    valveExercise.departedAt = 0;
+    valveExercise.arrivedAt = 0;
+    digitalWrite(PIN_VALVE_ON, HIGH);
+    return;
+  }
+
+  // stage 3 - reopen for the full rotation time, as applyValveState() does
+  if ((valveExercise.departedAt == 0) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW))
+    valveExercise.departedAt = nowMs;
+  if ((valveExercise.arrivedAt == 0) && (digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH))
+    valveExercise.arrivedAt = nowMs;
+  if (nowMs - valveExercise.stageAt < VALVE_ROTATION_TIME_MS)
+    return;
+
+  digitalWrite(PIN_VALVE_ON, LOW);
+  valveExercise.stage = 0;
+  if ((opParams.valveExerciseMode == 1) && (!valveExercise.demandAbort))
+    valveTravelRecord(VALVE_SERIES_OPEN, (valveExercise.arrivedAt != 0) ? (long)(valveExercise.arrivedAt - valveExercise.departedAt) : -1, -1);
+  else if (valveExercise.arrivedAt == 0)
+    valveWarning(VALVE_SERIES_OPEN, -1);           // did not make it back to the open stop
+
+  valveHealth.lastExercise = now();
+  valveHealthSave();
+  journalAppend(EVENT_VALVE_EXERCISE, opParams.valveExerciseMode + (valveExercise.demandAbort ? 2 : 0),
+                (valveExercise.breakawayMs != 0) ? (float)valveExercise.breakawayMs : -1, 0);
+  Serial.printf("%s Valve exercise finished%s\n", myTZ.dateTime("[H:i:s.v]").c_str(), valveExercise.demandAbort ? " - reversed early on water demand" : "");
+  valveHealthPublish();
+}
+
+//   ***************************
+//   **  valveResyncStart()   **
+//   ***************************
+
+// Starts driving the valve to target without holding the loop for VALVE_ROTATION_TIME_MS - valveResyncRun() releases the relay
+void valveResyncStart(byte target)
+{
+  valveResync.target = target;
+  valveResync.startedAt = millis();
+  valveResync.active = true;
+  digitalWrite((target == CLOSE_VALVE) ? PIN_VALVE_OFF : PIN_VALVE_ON, HIGH);
+  Serial.printf("%s valve...\n", (target == CLOSE_VALVE) ? "Closing" : "Opening");
+}
+
+//   ***************************
+//   **   valveResyncRun()    **
+//   ***************************
+
+void valveResyncRun()
+{
+  if (millis() - valveResync.startedAt < VALVE_ROTATION_TIME_MS)
+    return;
+  digitalWrite(PIN_VALVE_OFF, LOW);
+  digitalWrite(PIN_VALVE_ON, LOW);
+  valveResync.active = false;
+  char val[3];
+  sprintf(val, "%d", valveResync.target);
+  mqttClient.publish(VALVE_TOPIC, val, true);
+  valvePublishedAt = millis();
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TOPIC, val);
+}
+
+//   ***************************
+//   **   valveMoveAbort()    **
+//   ***************************
+
+// Stops any background valve move (exercise or post-connect resync) so the caller can drive the valve itself
+void valveMoveAbort()
+{
+  valveExerciseAbort();
+  if (!valveResync.active)
+    return;
+  digitalWrite(PIN_VALVE_OFF, LOW);
+  digitalWrite(PIN_VALVE_ON, LOW);
+  delay(VALVE_RELAY_DEADTIME_MS);
+  valveResync.active = false;
+  Serial.println(F("Valve resync cancelled"));
+}
+
+//   ***************************
+//   **  valveExerciseDue()   **
+//   ***************************
+
+// True once every valveExerciseDays, in the learned quietest hour of today (SPT_SCHEDULE_DEFAULT_HOUR until enough is learned)
+boolean valveExerciseDue()
+{
+  if ((opParams.valveExerciseDays == 0) || (timeStatus() != timeSet) || demandActive ||
+      ((valveHealth.lastExercise != 0) && (now() - valveHealth.lastExercise < (time_t)opParams.valveExerciseDays * 86400 - 3600)))
     return (false);
+
+  unsigned long learned = 0;
+  for (int d = 0; d < 7; d++)
+    for (int h = 0; h < 24; h++)
+      learned += demandHist[d][h];
+  int quietHour = SPT_SCHEDULE_DEFAULT_HOUR;
+  if (learned >= SPT_SCHEDULE_MIN_EVENTS)
+  {
+    byte *today = demandHist[myTZ.weekday() - 1];
+    for (int h = 0; h < 24; h++)
+      if (today[h] < today[quietHour])
+        quietHour = h;
+  }
+  return ((myTZ.hour() == quietHour) && (myTZ.minute() >= VALVE_EXERCISE_SLOT_OFFSET_MIN));
+}
+
+//   ***************************
+//   **  sptThermalCoeff()    **
+//   ***************************
+
+// PSI per C in effect - fitted over past tight tests (pressure rate = leak rate + coeff * temperature rate) in mode 2
+float sptThermalCoeff(boolean *fitted)
+{
+  *fitted = false;
+  if (opParams.sptThermalMode == 0)
+    return (0);
+  if (opParams.sptThermalMode == 2)
+  {
+    unsigned int n = min((unsigned int)sptThermalHist.count, (unsigned int)SPT_THERMAL_HISTORY);
+    if (n >= SPT_THERMAL_MIN_TESTS)
+    {
+      float meanX = 0, meanY = 0, sxx = 0, sxy = 0;
+      for (unsigned int i = 0; i < n; i++)
+      {
+        meanX += sptThermalHist.tempRate[i] / n;
+        meanY += sptThermalHist.pressRate[i] / n;
+      }
+      for (unsigned int i = 0; i < n; i++)
+      {
+        sxx += (sptThermalHist.tempRate[i] - meanX) * (sptThermalHist.tempRate[i] - meanX);
+        sxy += (sptThermalHist.tempRate[i] - meanX) * (sptThermalHist.pressRate[i] - meanY);
+      }
+      if (sxx / n > SPT_THERMAL_MIN_SPREAD)      // temperature must have varied between tests to separate it from leakage
+      {
+        *fitted = true;
+        return (sxy / sxx);
+      }
+    }
+  }
+  return (opParams.sptThermalCoeff);
+}
+
+//   ***************************
+//   **  sptThermalFinish()   **
+//   ***************************
+
+// Fits the traces of a completed test and publishes the compensated result - returns its attributes JSON in buf
+void sptThermalFinish(float rawResult, char *buf)
+{
+  sptThermal.active = false;
+  double n = sptThermal.n;
+  double den = n * sptThermal.sumXX - sptThermal.sumX * sptThermal.sumX;
+  if ((sptThermal.n < 3) || (den <= 0))
+  {
+    sprintf(buf, ", \"compensated_result\": \"%.2f\", \"thermal\": \"no_trace\"", rawResult);
+    mqttClient.publish(SPT_COMPENSATED_TOPIC, "not_valid", false);
+    Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_COMPENSATED_TOPIC, "not_valid");
+    return;
+  }
+  float pressRate = (n * sptThermal.sumXP - sptThermal.sumX * sptThermal.sumP) / den;  // PSI/min
+  float tempRate = (n * sptThermal.sumXT - sptThermal.sumX * sptThermal.sumT) / den;   // C/min
+  float tempChange = tempRate * (sptThermal.lastMs - sptThermal.startMs) / 60000.0;   // fitted change over the trace
+
+  boolean fitted;
+  float coeff = sptThermalCoeff(&fitted);
+  float compensated = rawResult - coeff * tempChange;
+  sprintf(msg, "%.2f", compensated);
+  mqttClient.publish(SPT_COMPENSATED_TOPIC, msg, false);
+  Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_COMPENSATED_TOPIC, msg);
+  sprintf(buf, ", \"compensated_result\": \"%.2f\", \"temperature_change_c\": \"%.3f\", \"pressure_rate\": \"%.3f\", "
+               "\"temperature_rate\": \"%.4f\", \"thermal_coeff\": \"%.2f\", \"thermal_coeff_fitted\": \"%d\"",
+          compensated, tempChange, pressRate, tempRate, coeff, fitted);
+
+  if (fabs(rawResult) <= SPT_THERMAL_TIGHT_PSI)    // tight system - this test can teach the coefficient
+  {
+    sptThermalHist.pressRate[sptThermalHist.count % SPT_THERMAL_HISTORY] = pressRate;
+    sptThermalHist.tempRate[sptThermalHist.count % SPT_THERMAL_HISTORY] = tempRate;
+    sptThermalHist.count++;
+    File thermFileObj = LittleFS.open(F(SPT_THERMAL_FILENAME), "w");
+    if (thermFileObj.write((uint8_t *)&sptThermalHist, sizeof(sptThermalHist)) != sizeof(sptThermalHist))
+      Serial.println(F("SPT thermal history file write error"));
+    thermFileObj.close();
   }
 }
 
+void sptScheduleNext(boolean aborted); // defined after sptStart()
+
 //   ***********************
 //   **      sptEnd()     **
 //   ***********************
 void sptEnd()
 {
+  char thermalAttr[256] = "";
   if (valveState == CLOSE_VALVE)  // SPT has terminated normally if valve has not been opened during test
   {
     // Publish result
@@ -314,6 +2132,8 @@ void sptEnd()
     mqttClient.publish(SPT_DATA_STATUS_TOPIC"/attributes", msg, true);  
     Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC"/attributes", msg);
     Serial.println(F("SPT event end: Normal"));
+    journalAppend(EVENT_SPT_RESULT, 0, medianPressure - sptBeginningPressure, opParams.sptDuration);
+    sptThermalFinish(medianPressure - sptBeginningPressure, thermalAttr);
   }
   else  // SPT terminated abnormally - manual has intervention occured, so test is not valid
   {
@@ -331,12 +2151,14 @@ void sptEnd()
     Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC"/attributes", msg);
 
     Serial.println(F("SPT event end: Aborted due to manual intervention"));
+    journalAppend(EVENT_SPT_ABORT, 0, 0, 0);
+    sptThermal.active = false;
 
   }
 
   // Publish attributes
-  sprintf(msg, "{\"test_end\": \"%s\", \"test_minutes\": \"%d\", \"beginning_pressure\": \"%.2f\", \"ending_pressure\": \"%.2f\"}",
-        myTZ.dateTime(RFC3339).c_str(), opParams.sptDuration, sptBeginningPressure, medianPressure);
+  sprintf(msg, "{\"test_end\": \"%s\", \"test_minutes\": \"%d\", \"beginning_pressure\": \"%.2f\", \"ending_pressure\": \"%.2f\"%s}",
+        myTZ.dateTime(RFC3339).c_str(), opParams.sptDuration, sptBeginningPressure, medianPressure, thermalAttr);
   mqttClient.publish(SPT_RESULT_TOPIC"/attributes", msg, false);    // do not publish with retain flag
   Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_RESULT_TOPIC"/attributes", msg);
 
@@ -345,107 +2167,553 @@ void sptEnd()
   opParams.minPublishInterval = pre_spt_minPublishInterval;    // restore minPublishInterval
   valveState = valvePreSPT;
   applyValveState(valvePreSPT, false);                         // restore the valveState to state before test
+
+  if (opParams.sptAutoSchedule == 1)
+    sptScheduleNext(strcmp(sptDataStatus, SPT_DATA_VALID) != 0);
+}
+
+//   ***********************
+//   **    sptStart()     **
+//   ***********************
+
+// Closes the valve & starts the Static Pressure Test - returns false if the test cannot run now
+boolean sptStart()
+{
+  valveMoveAbort();
+  if ( hasValve() && hasPressure() && (valveState == OPEN_VALVE) )
+  {
+    strcpy(sptDataStatus, SPT_DATA_IN_PROCESS);
+    sprintf(msg, "%s", sptDataStatus);
+    mqttClient.publish(SPT_DATA_STATUS_TOPIC, msg, true);
+    Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC, sptDataStatus);
+    
+    // zero SPT previous results to reset anything triggering on result values changing
+    mqttClient.publish(SPT_RESULT_TOPIC, "0.00", true);  
+    Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_RESULT_TOPIC, "0.00");
+    
+    valvePreSPT = valveState;
+    valveState = CLOSE_VALVE;
+    applyValveState(CLOSE_VALVE, false); // close the valve
+    valveNow = millis();
+    Serial.printf("Waiting %d msecs for pressure to settle\n", PRESSURE_SETTLING_DELAY_MS);
+    while (millis() - valveNow < PRESSURE_SETTLING_DELAY_MS) // wait for pressure to settle
+      yield();
+
+    pre_spt_idlePublishInterval = opParams.idlePublishInterval;
+    pre_spt_minPublishInterval = opParams.minPublishInterval;
+    opParams.idlePublishInterval = 15000;  // temporarily report every 15 secs during SPT if idle
+    opParams.minPublishInterval = SPT_MIN_PUBLISH_INTERVAL_MS;  // set to shorter interval during SPT
+    sptBeginningPressure = medianPressure;
+    memset(&sptThermal, 0, sizeof(sptThermal));
+    sptThermal.active = true;           // trace starts after the pressure has settled
+    Serial.printf("%s SPT Beginning Pressure = %.2f \n", myTZ.dateTime("[H:i:s.v]").c_str(), sptBeginningPressure);
+    journalAppend(EVENT_SPT_START, 0, sptBeginningPressure, 0);
+    sptDeadline = now() + (opParams.sptDuration * 60);
+    setEvent(sptEnd, sptDeadline); // use ezTime event handler & set event time
+    return (true);
+  }
+  Serial.println("Invalid request - both valve and pressure sensor must be installed valve must be in open position for SPT");
+  return (false);
+}
+
+//   ***********************
+//   **  sptAutoStart()   **
+//   ***********************
+
+// ezTime event for an on-device scheduled SPT
+void sptAutoStart()
+{
+  if (opParams.sptAutoSchedule != 1) // disabled since the event was set
+    return;
+  Serial.println(F("Scheduled SPT starting"));
+  if (!sptStart())
+    sptScheduleNext(true);   // valve closed or no sensor - retry later
+}
+
+//   ***************************
+//   **   sptScheduleNext()   **
+//   ***************************
+
+// Schedules the next SPT in the hour with the fewest learned demand events within the 24 hours following
+// a minimum gap: SPT_SCHEDULE_MIN_GAP_HOURS after a valid test, or an exponential backoff after an abort.
+void sptScheduleNext(boolean aborted)
+{
+  deleteEvent(sptAutoStart);
+  if ((opParams.sptAutoSchedule != 1) || (timeStatus() != timeSet))
+    return;
+
+  unsigned int gapHours;
+  if (aborted)
+  {
+    sptScheduleRetries++;
+    gapHours = (sptScheduleRetries < 6) ? (1 << (sptScheduleRetries - 1)) : SPT_SCHEDULE_MAX_BACKOFF_HOURS;
+    gapHours = min(gapHours, (unsigned int)SPT_SCHEDULE_MAX_BACKOFF_HOURS);
+  }
+  else
+  {
+    sptScheduleRetries = 0;
+    gapHours = SPT_SCHEDULE_MIN_GAP_HOURS;
+  }
+
+  unsigned long learned = 0;
+  for (int d = 0; d < 7; d++)
+    for (int h = 0; h < 24; h++)
+      learned += demandHist[d][h];
+
+  time_t localNow = myTZ.now();
+  time_t firstSlot = localNow - (localNow % 3600) + (time_t)gapHours * 3600;
+  if (firstSlot + SPT_SCHEDULE_SLOT_OFFSET_MIN * 60 <= localNow) // gap of zero would land in the past
+    firstSlot += 3600;
+  time_t bestSlot = 0;
+  int bestCount = 256;
+  for (int i = 0; i < 24; i++)
+  {
+    time_t slot = firstSlot + (time_t)i * 3600;
+    int count;
+    if (learned >= SPT_SCHEDULE_MIN_EVENTS)
+      count = demandHist[myTZ.weekday(slot, LOCAL_TIME) - 1][myTZ.hour(slot, LOCAL_TIME)];
+    else
+      count = (myTZ.hour(slot, LOCAL_TIME) == SPT_SCHEDULE_DEFAULT_HOUR) ? 0 : 1;
+    if (count < bestCount) // earliest slot wins a tie
+    {
+      bestCount = count;
+      bestSlot = slot;
+    }
+  }
+  bestSlot += SPT_SCHEDULE_SLOT_OFFSET_MIN * 60;
+  myTZ.setEvent(sptAutoStart, bestSlot, LOCAL_TIME);
+
+  sprintf(msg, "%s", myTZ.dateTime(bestSlot, LOCAL_TIME, RFC3339).c_str());
+  mqttClient.publish(SPT_SCHEDULE_TOPIC, msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s (slot demand %d, learned %lu, retries %d)\n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_SCHEDULE_TOPIC, msg,
+                bestCount, learned, sptScheduleRetries);
+}
+
+//   ***************************
+//   **   leakSubscribeAll()  **
+//   ***************************
+
+void leakSubscribeAll()
+{
+  for (int i = 0; i < LEAK_SENSOR_MAX; i++)
+    if (opParams.leakTopic[i][0] != (char)NULL)
+    {
+      mqttClient.subscribe(opParams.leakTopic[i]);
+      Serial.printf("Subscribed to leak sensor %d: %s\n", i, opParams.leakTopic[i]);
+    }
+}
+
+//   ***************************
+//   **     leakTrip()        **
+//   ***************************
+
+// A remote leak sensor tripped - close the valve here rather than waiting for the supervisory computer.
+// An SPT keeps the valve closed to its end & an exercise is cancelled.  Called on a dry to wet change, or while a sensor
+// stays wet if the valve has been reopened, so a sensor repeating its state does not journal every report.
+void leakTrip(int slot, unsigned long recvMs)
+{
+  boolean alreadyClosed = (valveState == CLOSE_VALVE) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH);
+  valveMoveAbort();
+  if (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0)
+    valvePreSPT = CLOSE_VALVE;         // the test may finish, but must not reopen the valve
+  long energizeMs = 0, confirmMs = 0;
+  if (!alreadyClosed)
+  {
+    valveState = CLOSE_VALVE;
+    applyValveState(CLOSE_VALVE, true);
+    energizeMs = (long)(valveEnergizedAt - recvMs);
+    confirmMs = (valveConfirmedAt != 0) ? (long)(valveConfirmedAt - recvMs) : -1;
+  }
+  sprintf(msg, "{\"time\": \"%s\", \"sensor\": \"%d\", \"topic\": \"%s\", \"already_closed\": \"%d\", \"energize_ms\": \"%ld\", \"confirm_ms\": \"%ld\"}",
+          myTZ.dateTime(RFC3339).c_str(), slot, opParams.leakTopic[slot], alreadyClosed, energizeMs, confirmMs);
+  mqttClient.publish(LEAK_TRIP_TOPIC, msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), LEAK_TRIP_TOPIC, msg);
+  journalAppend(EVENT_LEAK_TRIP, slot, energizeMs, confirmMs);
 }
 
 //   ***********************
 //   **  MQTT reconnect() **
 //   ***********************
 
+// One bounded step of a connection attempt to the current broker - the TCP connect on one call, the MQTT CONNECT &
+// CONNACK wait on the next, so loop() samples in between.  Each step still blocks up to its timeout (MQTT_CONNECT_TIMEOUT_MS,
+// MQTT_SOCKET_TIMEOUT_SECS): neither the ESP8266 WiFiClient nor PubSubClient can connect asynchronously.
+// Announcements are left to postConnectSync(); failures back off exponentially with jitter and fail over to the next broker.
 boolean reconnect()
 {
+  if (!espClient.connected())
+  {
+    mqttClient.setServer(mqttBrokers[mqttBrokerIndex], MQTT_PORT);
+    mqttStats.attempts++;
+    if (espClient.connect(mqttBrokers[mqttBrokerIndex], MQTT_PORT))
+    {
+      mqttRetryDelay = 0;                               // MQTT handshake on the next pass
+      return (false);
+    }
+    Serial.printf("TCP connect to %s failed\n", mqttBrokers[mqttBrokerIndex]);
+  }
   // PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
-  if (mqttClient.connect(DEVICE_NAME, MQTT_USER_NAME, MQTT_PASSWORD, LWT_TOPIC, 2, true, "Disconnected"))
+  // - skips its own TCP connect because the socket is already open
+  else if (mqttClient.connect(DEVICE_NAME, MQTT_USER_NAME, MQTT_PASSWORD, LWT_TOPIC, 2, true, "Disconnected"))
   {
     Serial.print(F("MQTT connected to "));
-    Serial.println(F(MQTT_SERVER));
+    Serial.println(mqttBrokers[mqttBrokerIndex]);
+    mqttBrokerFailures = 0;
+    mqttBackoff = MQTT_BACKOFF_MIN_MS;
+    mqttStats.connects++;
+    postConnectStage = 1;
+  }
+  else
+    Serial.printf("MQTT connect to %s failed, rc=%d\n", mqttBrokers[mqttBrokerIndex], mqttClient.state());
 
-    if (opParams.valveInstalled == 1)
+  if (!mqttClient.connected())
+  {
+    espClient.stop();
+    if (++mqttBrokerFailures >= MQTT_BROKER_FAILOVER_ATTEMPTS)
     {
-      // Sync valveState
+      mqttBrokerFailures = 0;
+      mqttBrokerIndex = (mqttBrokerIndex + 1) % (sizeof(mqttBrokers) / sizeof(mqttBrokers[0]));
+    }
+    mqttBackoff = min(mqttBackoff * 2, (unsigned long)MQTT_BACKOFF_MAX_MS);
+  }
+  mqttRetryDelay = mqttBackoff + random(mqttBackoff / 2);
+  return mqttClient.connected();
+}
+
+//   ***************************
+//   **  postConnectSync()    **
+//   ***************************
 
-      // if actual valve state cannot be determined, then use last saved state & set valve to match
-      if ((digitalRead(PIN_VALVE_ON_INDICATOR) == LOW) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW))
+// Runs one stage of the post-connect valve sync & announcements per call so a reconnect never
+// stalls sensor sampling with a burst of filesystem reads and publishes
+void postConnectSync()
+{
+  switch (postConnectStage)
+  {
+  case 1:
+    mqttClient.subscribe(RECV_COMMAND_TOPIC);          // subscribe first so no command is missed
+    if constexpr (HAS_VALVE)
+      leakSubscribeAll();                              // remote leak sensors close the valve without the supervisory computer
+    mqttClient.publish(LWT_TOPIC, "Connected", true);  // let broker know we're connected
+    Serial.printf("\n%s MQTT SENT: %s/Connected\n", myTZ.dateTime("[H:i:s.v]").c_str(), LWT_TOPIC);
+    break;
+  case 2:
+    if constexpr (HAS_VALVE)
+    {
+      if (hasValve() && (valveExercise.stage == 0) && (!valveResync.active))   // an exercise leaves the valve between stops on purpose
       {
-        Serial.println(F("Actual valve state cannot be determined. Setting valve to last saved state."));
+        // Sync valveState
 
-        if (LittleFS.exists(F(VALVE_STATE_FILENAME))) // if file exists
+        // if actual valve state cannot be determined, then use last saved state & set valve to match
+        if ((digitalRead(PIN_VALVE_ON_INDICATOR) == LOW) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW))
         {
-          valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
-          valveState = valveFileObj.read();
-          if (valveState != -1)
+          Serial.println(F("Actual valve state cannot be determined. Setting valve to last saved state."));
+
+          if (LittleFS.exists(F(VALVE_STATE_FILENAME))) // if file exists
           {
-            Serial.printf("Last valveState loaded from file: valveState = %d\n", valveState);
+            valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
+            valveState = valveFileObj.read();
+            if (valveState != -1)
+            {
+              Serial.printf("Last valveState loaded from file: valveState = %d\n", valveState);
+            }
+            else
+            {
+              Serial.println(F("valveState file read error.  valveState set to defined VALVE_ERROR_DEFAULT"));
+              valveState = VALVE_ERROR_DEFAULT;
+              if (valveFileObj.write((uint8_t *)&valveState, sizeof(valveState)) > 0)
+                Serial.printf("Valve file re-created: %s, %d bytes\n", valveFileObj.name(), valveFileObj.size());
+              else
+                Serial.println(F("Valve file re-creation error"));
+            }
+            valveFileObj.close();
           }
           else
-          {
-            Serial.println(F("valveState file read error.  valveState set to defined VALVE_ERROR_DEFAULT"));
-            valveState = VALVE_ERROR_DEFAULT;
+          { // fill it with default value
+            Serial.println(F("No valve file detected"));
+            valveState = 0;
+            valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "w+");
             if (valveFileObj.write((uint8_t *)&valveState, sizeof(valveState)) > 0)
-              Serial.printf("Valve file re-created: %s, %d bytes\n", valveFileObj.name(), valveFileObj.size());
+              Serial.printf("Valve file created: %s, %d bytes\n", valveFileObj.name(), valveFileObj.size());
             else
-              Serial.println(F("Valve file re-creation error"));
+              Serial.println(F("Valve file creation error"));
+            valveFileObj.close();
           }
-          valveFileObj.close();
+          valveResyncStart(valveState);                        // no need to write again - MQTT is updated when the drive ends
         }
         else
-        { // fill it with default value
-          Serial.println(F("No valve file detected"));
-          valveState = 0;
-          valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "w+");
-          if (valveFileObj.write((uint8_t *)&valveState, sizeof(valveState)) > 0)
-            Serial.printf("Valve file created: %s, %d bytes\n", valveFileObj.name(), valveFileObj.size());
-          else
-            Serial.println(F("Valve file creation error"));
-          valveFileObj.close();
-        }
-        applyValveState(valveState, false);                  // no need to write again, so just update MQTT
-      }
-      else
-      {
-        if ((digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH) && (valveState != 1))
-        {
-          Serial.println(F("ValveState set to actual: valveState=1"));
-          valveState = 1;
-          applyValveState(valveState, true);
-        }
-        if ((digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH) && (valveState != 0))
         {
-          Serial.println(F("ValveState set to actual: valveState=0"));
-          valveState = 0;
-          applyValveState(valveState, true);
+          // the indicator already shows where the valve is - save it without driving the valve there again
+          // (stage 7 publishes it)
+          if (((digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH) && (valveState != 1)) || ((digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH) && (valveState != 0)))
+          {
+            valveState = (digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH) ? 1 : 0;
+            Serial.printf("ValveState set to actual: valveState=%d\n", valveState);
+            valveFileObj = LittleFS.open(F(VALVE_STATE_FILENAME), "r+");
+            if (valveFileObj.write((uint8_t *)&valveState, sizeof(valveState)) > 0)
+              Serial.println(F("Valve state saved"));
+            else
+              Serial.println(F("Valve file update error"));
+            valveFileObj.close();
+          }
         }
       }
     }
-
-    // Publish MQTT announcements...
-
-    mqttClient.publish(LWT_TOPIC, "Connected", true); // let broker know we're connected
-    Serial.printf("\n%s MQTT SENT: %s/Connected\n", myTZ.dateTime("[H:i:s.v]").c_str(), LWT_TOPIC);
-
+    break;
+  case 3:
     mqttClient.publish(VERSION_TOPIC, VERSION, true); // report firmware version
     Serial.printf("%s MQTT SENT: Firmware %s\n", myTZ.dateTime("[H:i:s.v]").c_str(), VERSION);
-
+    break;
+  case 4:
     mqttClient.publish(LAST_BOOT_TOPIC, lastBoot, true);
     Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), LAST_BOOT_TOPIC, lastBoot);
-
+    break;
+  case 5:
     mqttClient.publish(SPT_DATA_STATUS_TOPIC, sptDataStatus, true); // refresh SPT data status
     Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC, sptDataStatus);
-
-    sprintf(msg, "{\"valveState\": \"%d\", \"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", \"idlePublishInterval\": \"%d\", "
-                 "\"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", \"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\"}\n\n",
-            valveState, opParams.version, opParams.valveInstalled, opParams.pressureInstalled, opParams.idlePublishInterval, opParams.minPublishInterval,
-            opParams.sensorReadInterval, opParams.sptPressureDrop, opParams.sptDemandWaterPercentDrop, opParams.sptDuration);
+    break;
+  case 6:
+    formatParams(msg);
     mqttClient.publish(REPORT_TOPIC, msg, true);
     Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), REPORT_TOPIC, msg);
-
+    break;
+  case 7:
     sprintf(msg, "%d", valveState);
     mqttClient.publish(VALVE_TOPIC, msg, true);
     Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), VALVE_TOPIC, msg);
+    break;
+  case 8:
+    if (!rtcResetReported)                            // once per boot
+    {
+      static const char *crumbNames[] = {"none", "setup", "events", "mqtt", "callback", "valve", "sensor", "publish", "spt", "idle"};
+      static const char *sptActions[] = {"none", "resumed", "aborted"};
+      sprintf(msg, "{\"boot\": \"%s\", \"reason\": \"%s\", \"breadcrumb\": \"%s\", \"restored\": \"%d\", \"snapshot_age_s\": \"%ld\", "
+                   "\"warm_restarts\": \"%u\", \"discarded\": \"%d\", \"spt\": \"%s\"}",
+              lastBoot, ESP.getResetReason().c_str(), (rtcBreadcrumbAtReset >= 0) ? crumbNames[rtcBreadcrumbAtReset] : "unknown", rtcSnapValid,
+              rtcSnapValid ? (long)(now() - rtcSnap.savedAt) : -1L, rtcWarmRestarts, rtcSnapDiscarded,
+              sptActions[rtcSptAction]);
+      mqttClient.publish(LAST_RESET_TOPIC, msg, true);
+      Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), LAST_RESET_TOPIC, msg);
+      rtcResetReported = true;
+    }
+    postConnectStage = 0;                             // all done
+    return;
+  }
+  postConnectStage++;
+}
+
+//   ***************************
+//   **  mqttStatsPublish()   **
+//   ***************************
+
+// Publishes what this unit has cost the broker since boot plus the rate since the previous report.
+// Rates from every controller sum to the fleet load, so defaults can be sized against real broker capacity.
+void mqttStatsPublish()
+{
+  unsigned long nowMs = millis();
+  float mins = (nowMs - mqttStats.lastReportMs) / 60000.0;
+  if (mins <= 0)
+    mins = 1;
+  // count this report too so the totals match what the broker sees
+  unsigned long msgs = mqttClient.msgs + 1;
+  sprintf(msg, "{\"uptime_s\": \"%lu\", \"msgs\": \"%lu\", \"bytes\": \"%lu\", \"retained_msgs\": \"%lu\", \"retained_bytes\": \"%lu\", "
+               "\"msgs_per_min\": \"%.2f\", \"bytes_per_min\": \"%.1f\", \"received\": \"%lu\", \"received_bytes\": \"%lu\", "
+               "\"connects\": \"%lu\", \"connect_attempts\": \"%lu\"}",
+          nowMs / 1000, msgs, mqttClient.bytes, mqttClient.retainedMsgs, mqttClient.retainedBytes,
+          (msgs - mqttStats.lastMsgs) / mins, (mqttClient.bytes - mqttStats.lastBytes) / mins,
+          mqttStats.received, mqttStats.receivedBytes, mqttStats.connects, mqttStats.attempts);
+  mqttClient.publish(MQTT_STATS_TOPIC, msg, true);
+  Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), MQTT_STATS_TOPIC, msg);
+  mqttStats.lastReportMs = nowMs;
+  mqttStats.lastMsgs = mqttClient.msgs;
+  mqttStats.lastBytes = mqttClient.bytes;
+}
+
+// Numeric parameters settable by setParams - every key of the batch must be one of these
+#define PARAM_UINT 0
+#define PARAM_FLOAT 1
+struct ParamField
+{
+  const char *name;
+  byte type;
+  size_t offset;
+};
+
+const struct ParamField paramFields[] = {
+  {"valveInstalled", PARAM_UINT, offsetof(Parameters, valveInstalled)},
+  {"pressureInstalled", PARAM_UINT, offsetof(Parameters, pressureInstalled)},
+  {"idlePublishInterval", PARAM_UINT, offsetof(Parameters, idlePublishInterval)},
+  {"minPublishInterval", PARAM_UINT, offsetof(Parameters, minPublishInterval)},
+  {"sensorReadInterval", PARAM_UINT, offsetof(Parameters, sensorReadInterval)},
+  {"sptPressureDrop", PARAM_FLOAT, offsetof(Parameters, sptPressureDrop)},
+  {"sptDemandWaterPercentDrop", PARAM_FLOAT, offsetof(Parameters, sptDemandWaterPercentDrop)},
+  {"sptDuration", PARAM_UINT, offsetof(Parameters, sptDuration)},
+  {"adaptiveSampling", PARAM_UINT, offsetof(Parameters, adaptiveSampling)},
+  {"fastReadInterval", PARAM_UINT, offsetof(Parameters, fastReadInterval)},
+  {"slowReadInterval", PARAM_UINT, offsetof(Parameters, slowReadInterval)},
+  {"adaptiveSlopeThreshold", PARAM_FLOAT, offsetof(Parameters, adaptiveSlopeThreshold)},
+  {"publishMode", PARAM_UINT, offsetof(Parameters, publishMode)},
+  {"sdtDeviation", PARAM_FLOAT, offsetof(Parameters, sdtDeviation)},
+  {"passiveStartHour", PARAM_UINT, offsetof(Parameters, passiveStartHour)},
+  {"passiveEndHour", PARAM_UINT, offsetof(Parameters, passiveEndHour)},
+  {"sptAutoSchedule", PARAM_UINT, offsetof(Parameters, sptAutoSchedule)},
+  {"valveExerciseDays", PARAM_UINT, offsetof(Parameters, valveExerciseDays)},
+  {"valveExerciseMode", PARAM_UINT, offsetof(Parameters, valveExerciseMode)},
+  {"sptThermalMode", PARAM_UINT, offsetof(Parameters, sptThermalMode)},
+  {"sptThermalCoeff", PARAM_FLOAT, offsetof(Parameters, sptThermalCoeff)},
+};
+
+//   ***************************
+//   **    paramsParseJson()  **
+//   ***************************
 
-    // ... and resubscribe
-    mqttClient.subscribe(RECV_COMMAND_TOPIC);
+// Applies a flat JSON object of numbers (quoted or not) to *staging straight from the MQTT payload - no copy, no allocation.
+// Keys in the reportParams output that are not settable (valveState, version, leakSensors, and valveInstalled & pressureInstalled
+// outside PROFILE_FULL where the build fixes them) are skipped, so a report can be edited & sent back.  "persist": 1 is returned in *persist.  Returns the number of fields set, or -1 with *err set.
+int paramsParseJson(const byte *json, unsigned int length, struct Parameters *staging, boolean *persist, const char **err)
+{
+  unsigned int i = 0;
+  int fields = 0;
+  *persist = false;
+  auto skipSpace = [&]() { while ((i < length) && isspace(json[i])) i++; };
+
+  skipSpace();
+  if ((i >= length) || (json[i++] != '{'))
+  {
+    *err = "expected {";
+    return (-1);
   }
-  return mqttClient.connected();
+  skipSpace();
+  if ((i < length) && (json[i] == '}'))
+    return (0);
+  while (i < length)
+  {
+    // key - no escapes in parameter names
+    if (json[i++] != '"')
+    {
+      *err = "expected key";
+      return (-1);
+    }
+    const char *key = (const char *)&json[i];
+    while ((i < length) && (json[i] != '"'))
+      i++;
+    if (i >= length)
+    {
+      *err = "unterminated key";
+      return (-1);
+    }
+    unsigned int keyLen = (const char *)&json[i] - key;
+    i++;
+    skipSpace();
+    if ((i >= length) || (json[i++] != ':'))
+    {
+      *err = "expected :";
+      return (-1);
+    }
+    skipSpace();
+
+    // value - number, optionally quoted as in the reportParams output
+    boolean quoted = (i < length) && (json[i] == '"');
+    if (quoted)
+      i++;
+    boolean negative = false, digits = false;
+    double value = 0, scale = 0;
+    if ((i < length) && (json[i] == '-'))
+    {
+      negative = true;
+      i++;
+    }
+    for (; i < length; i++)
+    {
+      if (isdigit(json[i]))
+      {
+        digits = true;
+        if (scale == 0)
+          value = value * 10 + (json[i] - '0');
+        else
+        {
+          value += (json[i] - '0') * scale;
+          scale /= 10;
+        }
+      }
+      else if ((json[i] == '.') && (scale == 0))
+        scale = 0.1;
+      else
+        break;
+    }
+    boolean skipped = false;
+    boolean clean = (!quoted) || ((i < length) && (json[i] == '"'));  // quoted value holds nothing but the number
+    if (quoted)
+    {
+      while ((i < length) && (json[i] != '"'))  // non-numeric text is only allowed for skipped keys
+        i++;
+      if (i >= length)
+      {
+        *err = "unterminated value";
+        return (-1);
+      }
+      i++;
+    }
+    if (negative)
+      value = -value;
+
+    const struct ParamField *field = NULL;
+    for (unsigned int f = 0; f < sizeof(paramFields) / sizeof(paramFields[0]); f++)
+      if ((strlen(paramFields[f].name) == keyLen) && (strncmp(paramFields[f].name, key, keyLen) == 0))
+        field = &paramFields[f];
+    if ((keyLen == 7) && (strncmp(key, "persist", 7) == 0))
+    {
+      *persist = digits && (value == 1);
+      skipped = true;
+    }
+    else if (((keyLen == 10) && (strncmp(key, "valveState", 10) == 0)) || ((keyLen == 7) && (strncmp(key, "version", 7) == 0)) ||
+             ((keyLen == 11) && (strncmp(key, "leakSensors", 11) == 0)))
+      skipped = true;
+    else if ((BUILD_PROFILE != PROFILE_FULL) && (field != NULL) &&
+             ((field->offset == offsetof(Parameters, valveInstalled)) || (field->offset == offsetof(Parameters, pressureInstalled))))
+      skipped = true;                                  // same as the single commands - only PROFILE_FULL selects installed hardware
+    else if (field == NULL)
+    {
+      *err = "unknown key";
+      return (-1);
+    }
+    if (!skipped)
+    {
+      if ((!digits) || (!clean))
+      {
+        *err = "expected number";
+        return (-1);
+      }
+      if (field->type == PARAM_UINT)
+      {
+        if (negative || (value > (double)UINT_MAX) || (value != floor(value)))   // range first - casting a larger double is undefined
+        {
+          *err = "expected unsigned integer";
+          return (-1);
+        }
+        *(unsigned int *)((byte *)staging + field->offset) = (unsigned int)value;
+      }
+      else
+        *(float *)((byte *)staging + field->offset) = (float)value;
+      fields++;
+    }
+
+    skipSpace();
+    if (i >= length)
+      break;
+    if (json[i] == ',')
+    {
+      i++;
+      skipSpace();
+      continue;
+    }
+    if (json[i] == '}')
+      return (fields);
+    *err = "expected , or }";
+    return (-1);
+  }
+  *err = "unterminated object";
+  return (-1);
 }
 
 //   ***********************
@@ -455,7 +2723,41 @@ boolean reconnect()
 void callback(char *topic, byte *payload, unsigned int length)
 {
   // handle MQTT message arrival
+  unsigned long recvNow = millis(); // first stage of valve command latency trace
+  rtcBreadcrumb(BC_CALLBACK);
   bool cmdValid = false;
+
+  // Remote leak sensors are checked first - nothing else stands between a trip and the valve closing
+  if (strncmp(topic, CMD_TOPIC_PREFIX, strlen(CMD_TOPIC_PREFIX)) != 0)
+  {
+    if constexpr (HAS_VALVE)
+    {
+      for (int i = 0; i < LEAK_SENSOR_MAX; i++)
+      {
+        if ((opParams.leakTopic[i][0] != (char)NULL) && (strcmp(topic, opParams.leakTopic[i]) == 0) && (length < MSG_BUFFER_SIZE))
+        {
+          strncpy(msg, (char *)payload, length);
+          msg[length] = (char)NULL;
+          if (strstr(msg, opParams.leakPayload[i]) != NULL)
+          {
+            if ((!leakWet[i]) || (valveState != CLOSE_VALVE))
+            {
+              Serial.printf("\n%s LEAK SENSOR %d TRIPPED: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), i, topic, msg);
+              if (hasValve())
+                leakTrip(i, recvNow);
+            }
+            leakWet[i] = true;
+            return;
+          }
+          leakWet[i] = false;
+        }
+      }
+    }
+    msg[0] = (char)NULL;
+    return;                            // not a command
+  }
+  mqttStats.received++;
+  mqttStats.receivedBytes += strlen(topic) + length + MQTT_PUBLISH_OVERHEAD_BYTES;
   strncpy(msg, (char *)payload, length);
   msg[length] = (char)NULL; // terminate the string
   Serial.printf("\n%s MQTT RECVD: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), topic, msg);
@@ -468,10 +2770,40 @@ void callback(char *topic, byte *payload, unsigned int length)
   //   minPublishInterval/<new_value>         - assigns a <new_value>, but does not save to NVM
   //   sensorReadInterval/<new_value>         - assigns a <new_value>, but does not save to NVM
   //   sptDuration/<new_value>                - assigns a <new_value> in minutes, but does not save to NVM
+  //   adaptiveSampling/<new_value>           - 1 = read rate follows pressure dynamics, 0 = fixed sensorReadInterval, but does not save to NVM
+  //   fastReadInterval/<new_value>           - assigns a <new_value> in msecs (adaptive sampling during transients), but does not save to NVM
+  //   slowReadInterval/<new_value>           - assigns a <new_value> in msecs (adaptive sampling floor when stable), but does not save to NVM
+  //   adaptiveSlopeThreshold/<new_value>     - assigns a <new_value> in PSI/sec, but does not save to NVM
+  //   publishMode/<new_value>                - 0 = publish on sptPressureDrop change, 1 = swinging door compression, but does not save to NVM
+  //   sdtDeviation/<new_value>               - assigns a <new_value> in PSI (swinging door error bound), but does not save to NVM
+  //   passiveStartHour/<new_value>           - local hour 0-23 the passive leak estimation window opens, but does not save to NVM
+  //   passiveEndHour/<new_value>             - local hour 0-23 the window closes & the score is published, but does not save to NVM
   //   valveState/<new_value>                 - 1 = OPEN, 0 = CLOSED, assigns and SAVES new value to NVM
+  //                                            optionally <new_value>,<correlation_id> - latency trace is published to VALVE_TRACE_TOPIC
+  //   valveExerciseDays/<new_value>          - exercise the valve every <new_value> days (0 = never, max 90), but does not save to NVM
+  //   valveExerciseMode/<new_value>          - 0 = partial close & reopen, 1 = full close & reopen, but does not save to NVM
+  //   valveExercise  - exercises the valve now (valve must be open)
+  //   valveHealth    - publishes the valve travel time trend to VALVE_HEALTH_TOPIC
+  //   leakSensorAdd/<topic>|<payload>        - remote leak sensor: the valve closes when a message on <topic> contains <payload>,
+  //                                            assigns the first free slot & subscribes, but does not save to NVM
+  //   leakSensorDel/<slot>                   - removes leak sensor <slot> (0-3), but does not save to NVM
+  //   leakSensorList - publishes the configured leak sensors to LEAK_SENSORS_TOPIC
   //   sptPressureDrop/<new_value>            - assings a <new_value> in PSI, but does not save to NVM
   //   sptDemandWaterPercentDrop/<new_value>  - assigns a <new_value> in PSI, but does not save to NVM
+  //   sptAutoSchedule/<new_value>            - 1 = device schedules daily SPTs in the learned lowest-demand hour, but does not save to NVM
+  //   sptThermalMode/<new_value>             - 0 = no temperature compensation, 1 = use sptThermalCoeff, 2 = fit from past tests, but does not save to NVM
+  //   sptThermalCoeff/<new_value>            - assigns a <new_value> in PSI per degree C (-50 to 50), but does not save to NVM
   //   sptStart       - starts the Static Pressure Test
+  //   demandReport   - publishes the learned demand histogram to DEMAND_HIST_TOPIC
+  //   fixtureReport  - publishes today's draw counts per fixture type to FIXTURE_COUNTS_TOPIC
+  //   events/<start>,<end> - publishes journaled events between UTC epoch seconds <start> and <end> to EVENTS_TOPIC in pages
+  //                          (<end> defaults to now, no range returns the last 24 hours)
+  //   ping/<token>   - echoes <token> to PONG_TOPIC immediately so the sender can time the command round trip
+  //   mqttStats      - publishes this unit's broker load to MQTT_STATS_TOPIC
+  //   setParams/<json>  - sets many parameters at once, e.g. {"sptDuration": 5, "publishMode": 1, "persist": 1}
+  //                       all fields are validated together & applied only if the whole set is valid - "persist": 1 also saves to NVM
+  //                       (rejected during an SPT, which temporarily changes the publish intervals).
+  //                       The outcome is published to SET_PARAMS_TOPIC.
   //   reportParams   - publishes parameters to REPORT_TOPIC replacing previous retained report on broker
   //   defaultParams  - sets parameters to default firmware values, but does not save to NVM
   //   readParams     - reads parameters from NVM storage, but does not save to NVM
@@ -536,27 +2868,33 @@ void callback(char *topic, byte *payload, unsigned int length)
     else
       Serial.println("Invalid sptDemandWaterPercentDrop value");
   }
-  if (strstr(topic, "valveInstalled")) // valveInstalled = 1 if valve is installed, valveInstalled = 0 otherwise
+  if constexpr (BUILD_PROFILE == PROFILE_FULL)
   {
-    cmdValid = true;
-    if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+    if (strstr(topic, "valveInstalled")) // valveInstalled = 1 if valve is installed, valveInstalled = 0 otherwise
     {
-      Serial.printf("valveInstalled set to %s\n", msg);
-      opParams.valveInstalled = atoi(msg);
+      cmdValid = true;
+      if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+      {
+        Serial.printf("valveInstalled set to %s\n", msg);
+        opParams.valveInstalled = atoi(msg);
+      }
+      else
+        Serial.println("Invalid valveInstalled value");
     }
-    else
-      Serial.println("Invalid valveInstalled value");
   }
-  if (strstr(topic, "pressureInstalled")) // pressureInstalled = 1 if valve is installed, pressureInstalled = 0 otherwise
+  if constexpr (BUILD_PROFILE == PROFILE_FULL)
   {
-    cmdValid = true;
-    if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+    if (strstr(topic, "pressureInstalled")) // pressureInstalled = 1 if valve is installed, pressureInstalled = 0 otherwise
     {
-      Serial.printf("pressureInstalled set to %s\n", msg);
-      opParams.pressureInstalled = atoi(msg);
+      cmdValid = true;
+      if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+      {
+        Serial.printf("pressureInstalled set to %s\n", msg);
+        opParams.pressureInstalled = atoi(msg);
+      }
+      else
+        Serial.println("Invalid pressureInstalled value");
     }
-    else
-      Serial.println("Invalid pressureInstalled value");
   }
   if (strstr(topic, "sptDuration")) // duration of Static Pressure Test in millisec
   {
@@ -569,72 +2907,351 @@ void callback(char *topic, byte *payload, unsigned int length)
     else
       Serial.println("Invalid sptDuration value");
   }
-  if (strstr(topic, "sptStart")) // start the Static Pressure Test
+  if (strstr(topic, "adaptiveSampling")) // adaptiveSampling = 1 to let pressure dynamics drive the read rate
+  {
+    cmdValid = true;
+    if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+    {
+      Serial.printf("adaptiveSampling set to %s\n", msg);
+      opParams.adaptiveSampling = atoi(msg);
+    }
+    else
+      Serial.println("Invalid adaptiveSampling value");
+  }
+  if (strstr(topic, "fastReadInterval")) // adaptive sampling read interval during a transient
+  {
+    cmdValid = true;
+    if ((atoi(msg) > 3) && ((unsigned int)atoi(msg) <= opParams.slowReadInterval))
+    {
+      Serial.printf("fastReadInterval set to %s\n", msg);
+      opParams.fastReadInterval = atoi(msg);
+    }
+    else
+      Serial.println("Invalid fastReadInterval value");
+  }
+  if (strstr(topic, "slowReadInterval")) // adaptive sampling read interval when pressure is stable
+  {
+    cmdValid = true;
+    if ((unsigned int)atoi(msg) >= opParams.fastReadInterval)
+    {
+      Serial.printf("slowReadInterval set to %s\n", msg);
+      opParams.slowReadInterval = atoi(msg);
+    }
+    else
+      Serial.println("Invalid slowReadInterval value");
+  }
+  if (strstr(topic, "adaptiveSlopeThreshold")) // pressure slope that triggers fast sampling
   {
     cmdValid = true;
-    if ( (opParams.valveInstalled == 1) && (opParams.pressureInstalled == 1) && (valveState == OPEN_VALVE) )
-    {
-      strcpy(sptDataStatus, SPT_DATA_IN_PROCESS);
-      sprintf(msg, "%s", sptDataStatus);
-      mqttClient.publish(SPT_DATA_STATUS_TOPIC, msg, true);
-      Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC, sptDataStatus);
-      
-      // zero SPT previous results to reset anything triggering on result values changing
-      mqttClient.publish(SPT_RESULT_TOPIC, "0.00", true);  
-      Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_RESULT_TOPIC, "0.00");
-      
-      valvePreSPT = valveState;
-      valveState = CLOSE_VALVE;
-      applyValveState(CLOSE_VALVE, false); // close the valve
-      valveNow = millis();
-      Serial.printf("Waiting %d msecs for pressure to settle\n", PRESSURE_SETTLING_DELAY_MS);
-      while (millis() - valveNow < PRESSURE_SETTLING_DELAY_MS) // wait for pressure to settle
-        yield();
-
-      pre_spt_idlePublishInterval = opParams.idlePublishInterval;
-      pre_spt_minPublishInterval = opParams.minPublishInterval;
-      opParams.idlePublishInterval = 15000;  // temporarily report every 15 secs during SPT if idle
-      opParams.minPublishInterval = SPT_MIN_PUBLISH_INTERVAL_MS;  // set to shorter interval during SPT
-      sptBeginningPressure = medianPressure;
-      Serial.printf("%s SPT Beginning Pressure = %.2f \n", myTZ.dateTime("[H:i:s.v]").c_str(), sptBeginningPressure);
-      setEvent(sptEnd, now() + (opParams.sptDuration * 60)); // use ezTime event handler & set event time
+    if (atof(msg) > 0)
+    {
+      Serial.printf("adaptiveSlopeThreshold set to %s\n", msg);
+      opParams.adaptiveSlopeThreshold = atof(msg);
     }
     else
-      Serial.println("Invalid request - both valve and pressure sensor must be installed valve must be in open position for SPT");
+      Serial.println("Invalid adaptiveSlopeThreshold value");
   }
-  if (strstr(topic, "valveState")) // set valve 0=closed 1=open
+  if (strstr(topic, "publishMode")) // 0 = change threshold publishing, 1 = swinging door compression
   {
     cmdValid = true;
     if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
     {
-      valveState = atoi(msg);
-      applyValveState(valveState, true);
+      Serial.printf("publishMode set to %s\n", msg);
+      opParams.publishMode = atoi(msg);
+      sdt.started = false; // restart compression from the next sample
+    }
+    else
+      Serial.println("Invalid publishMode value");
+  }
+  if (strstr(topic, "sdtDeviation")) // swinging door error bound
+  {
+    cmdValid = true;
+    if (atof(msg) >= .01)
+    {
+      Serial.printf("sdtDeviation set to %s\n", msg);
+      opParams.sdtDeviation = atof(msg);
+    }
+    else
+      Serial.println("Invalid sdtDeviation value");
+  }
+  if (strstr(topic, "passiveStartHour")) // start of nightly passive leak estimation window
+  {
+    cmdValid = true;
+    if ((isdigit(msg[0])) && (atoi(msg) <= 23))
+    {
+      Serial.printf("passiveStartHour set to %s\n", msg);
+      opParams.passiveStartHour = atoi(msg);
+    }
+    else
+      Serial.println("Invalid passiveStartHour value");
+  }
+  if (strstr(topic, "passiveEndHour")) // end of nightly passive leak estimation window
+  {
+    cmdValid = true;
+    if ((isdigit(msg[0])) && (atoi(msg) <= 23))
+    {
+      Serial.printf("passiveEndHour set to %s\n", msg);
+      opParams.passiveEndHour = atoi(msg);
+    }
+    else
+      Serial.println("Invalid passiveEndHour value");
+  }
+  if constexpr (HAS_SPT)
+  {
+    if (strstr(topic, "sptAutoSchedule")) // on-device SPT scheduling
+    {
+      cmdValid = true;
+      if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+      {
+        Serial.printf("sptAutoSchedule set to %s\n", msg);
+        opParams.sptAutoSchedule = atoi(msg);
+        sptScheduleRetries = 0;
+        sptScheduleNext(false);
+        if (opParams.sptAutoSchedule != 1)
+          mqttClient.publish(SPT_SCHEDULE_TOPIC, "", true);  // clear retained schedule
+      }
+      else
+        Serial.println("Invalid sptAutoSchedule value");
+    }
+    if (strstr(topic, "sptThermalMode")) // SPT temperature compensation
+    {
+      cmdValid = true;
+      if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0) || (strcmp(msg, "2") == 0))
+      {
+        Serial.printf("sptThermalMode set to %s\n", msg);
+        opParams.sptThermalMode = atoi(msg);
+      }
+      else
+        Serial.println("Invalid sptThermalMode value");
+    }
+    if (strstr(topic, "sptThermalCoeff")) // fixed PSI per C
+    {
+      cmdValid = true;
+      if ((msg[0] != (char)NULL) && (fabs(atof(msg)) <= 50))
+      {
+        Serial.printf("sptThermalCoeff set to %s\n", msg);
+        opParams.sptThermalCoeff = atof(msg);
+      }
+      else
+        Serial.println("Invalid sptThermalCoeff value");
+    }
+  }
+  if (strstr(topic, "demandReport")) // publish learned demand histogram, one row of 24 hours per weekday
+  {
+    cmdValid = true;
+    int n = sprintf(msg, "{");
+    for (int d = 0; d < 7; d++)
+    {
+      n += sprintf(msg + n, "%s\"%d\": [", (d > 0) ? ", " : "", d);
+      for (int h = 0; h < 24; h++)
+        n += sprintf(msg + n, "%s%d", (h > 0) ? "," : "", demandHist[d][h]);
+      n += sprintf(msg + n, "]");
+    }
+    sprintf(msg + n, "}");
+    mqttClient.publish(DEMAND_HIST_TOPIC, msg, true);
+    Serial.printf("%s demandReport > MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), DEMAND_HIST_TOPIC, msg);
+  }
+  if (strstr(topic, "fixtureReport")) // publish today's fixture counts
+  {
+    cmdValid = true;
+    fixturePublishCounts();
+  }
+  if constexpr (HAS_SPT)
+  {
+    if (strstr(topic, "sptStart")) // start the Static Pressure Test
+    {
+      cmdValid = true;
+      sptStart();
+    }
+  }
+  if constexpr (HAS_VALVE)
+  {
+    if (strstr(topic, "valveState")) // set valve 0=closed 1=open
+    {
+      cmdValid = true;
+      char *traceId = strchr(msg, ',');   // optional correlation ID follows the state
+      if (traceId != NULL)
+        *traceId++ = (char)NULL;
+      if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+      {
+        valveTrace.recvMs = recvNow;
+        int n = 0;
+        while ((traceId != NULL) && (*traceId != (char)NULL) && (n < (int)sizeof(valveTrace.id) - 1))
+        {
+          if (isalnum(*traceId) || (strchr("-_.:", *traceId) != NULL))  // keep the ID JSON-safe
+            valveTrace.id[n++] = *traceId;
+          traceId++;
+        }
+        valveTrace.id[n] = (char)NULL;
+        valveMoveAbort();                 // a command always wins over an exercise or resync in progress
+        valveState = atoi(msg);
+        applyValveState(valveState, true);
+        valveTracePublish(valveState);
+      }
+      else
+        Serial.println(F("Invalid valveState requested"));
+    }
+    if (strstr(topic, "valveExerciseDays")) // days between valve exercises
+    {
+      cmdValid = true;
+      if ((isdigit(msg[0])) && (atoi(msg) <= 90))
+      {
+        Serial.printf("valveExerciseDays set to %s\n", msg);
+        opParams.valveExerciseDays = atoi(msg);
+      }
+      else
+        Serial.println("Invalid valveExerciseDays value");
+    }
+    else if (strstr(topic, "valveExerciseMode")) // partial or full exercise
+    {
+      cmdValid = true;
+      if ((strcmp(msg, "0") == 0) || (strcmp(msg, "1") == 0))
+      {
+        Serial.printf("valveExerciseMode set to %s\n", msg);
+        opParams.valveExerciseMode = atoi(msg);
+      }
+      else
+        Serial.println("Invalid valveExerciseMode value");
+    }
+    else if (strstr(topic, "valveExercise")) // exercise now
+    {
+      cmdValid = true;
+      valveExerciseStart();
+    }
+    if (strstr(topic, "valveHealth")) // publish travel time trend
+    {
+      cmdValid = true;
+      valveHealthPublish();
+    }
+    if (strstr(topic, "leakSensorAdd")) // subscribe to a remote leak sensor
+    {
+      cmdValid = true;
+      char *sep = strchr(msg, '|');
+      int slot = -1;
+      for (int i = LEAK_SENSOR_MAX - 1; i >= 0; i--)
+        if (opParams.leakTopic[i][0] == (char)NULL)
+          slot = i;
+      if ((sep != NULL) && (sep > msg) && (sep - msg < LEAK_TOPIC_LEN) && (strlen(sep + 1) > 0) && (strlen(sep + 1) < LEAK_PAYLOAD_LEN) &&
+          (strncmp(msg, CMD_TOPIC_PREFIX, strlen(CMD_TOPIC_PREFIX)) != 0) && (strpbrk(msg, "#+") == NULL) && (slot >= 0))
+      {
+        *sep = (char)NULL;
+        strcpy(opParams.leakTopic[slot], msg);
+        strcpy(opParams.leakPayload[slot], sep + 1);
+        leakWet[slot] = false;
+        mqttClient.subscribe(opParams.leakTopic[slot]);
+        Serial.printf("Leak sensor %d set to %s, trips on %s\n", slot, opParams.leakTopic[slot], opParams.leakPayload[slot]);
+      }
+      else
+        Serial.println("Invalid leakSensorAdd value or no free slot");
+    }
+    if (strstr(topic, "leakSensorDel")) // forget a remote leak sensor
+    {
+      cmdValid = true;
+      int slot = atoi(msg);
+      if (isdigit(msg[0]) && (slot < LEAK_SENSOR_MAX) && (opParams.leakTopic[slot][0] != (char)NULL))
+      {
+        mqttClient.unsubscribe(opParams.leakTopic[slot]);
+        Serial.printf("Leak sensor %d (%s) removed\n", slot, opParams.leakTopic[slot]);
+        opParams.leakTopic[slot][0] = (char)NULL;
+        opParams.leakPayload[slot][0] = (char)NULL;
+      }
+      else
+        Serial.println("Invalid leakSensorDel value");
+    }
+    if (strstr(topic, "leakSensorList")) // report remote leak sensors
+    {
+      cmdValid = true;
+      int n = sprintf(msg, "{");
+      for (int i = 0; i < LEAK_SENSOR_MAX; i++)
+        n += sprintf(msg + n, "%s\"%d\": {\"topic\": \"%s\", \"payload\": \"%s\"}", (i > 0) ? ", " : "", i,
+                     opParams.leakTopic[i], opParams.leakPayload[i]);
+      sprintf(msg + n, "}");
+      mqttClient.publish(LEAK_SENSORS_TOPIC, msg, true);
+      Serial.printf("%s leakSensorList > MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), LEAK_SENSORS_TOPIC, msg);
+    }
+  }
+  if (strstr(topic, "events")) // stream event journal records for a time range
+  {
+    cmdValid = true;
+    uint32_t end = now();
+    uint32_t start = end - JOURNAL_DEFAULT_QUERY_SECS;
+    char *sep = strchr(msg, ',');
+    if (msg[0] != (char)NULL)
+      start = strtoul(msg, NULL, 10);
+    if (sep != NULL)
+      end = strtoul(sep + 1, NULL, 10);
+    Serial.printf("Event journal query %lu..%lu\n", (unsigned long)start, (unsigned long)end);
+    journalQueryStart(start, end);
+  }
+  if (strstr(topic, "ping")) // round-trip timing - answer before anything else is queued
+  {
+    cmdValid = true;
+    mqttClient.publish(PONG_TOPIC, msg, false);
+    Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PONG_TOPIC, msg);
+  }
+  if (strstr(topic, "mqttStats")) // report broker load
+  {
+    cmdValid = true;
+    mqttStatsPublish();
+  }
+  if (strstr(topic, "setParams")) // batch update - all or nothing
+  {
+    cmdValid = true;
+    struct Parameters staging = opParams;
+    boolean persist;
+    const char *err = "";
+    int fields = paramsParseJson(payload, length, &staging, &persist, &err);
+    if ((fields >= 0) && (!paramsValid(staging)))
+    {
+      fields = -1;
+      err = "values out of range";
+    }
+    if ((fields >= 0) && persist && (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0))
+    {
+      fields = -1;                                         // opParams holds the SPT publish intervals until it ends
+      err = "persist not allowed during an SPT";
+    }
+    boolean saved = false;
+    if (fields >= 0)
+    {
+      boolean scheduleChanged = (staging.sptAutoSchedule != opParams.sptAutoSchedule);
+      if (staging.publishMode != opParams.publishMode)
+        sdt.started = false;                               // restart compression from the next sample
+      opParams = staging;                                  // one assignment - loop() never sees a partial set
+      if constexpr (HAS_SPT)
+      {
+        if (scheduleChanged)
+        {
+          sptScheduleRetries = 0;
+          sptScheduleNext(false);
+          if (opParams.sptAutoSchedule != 1)
+            mqttClient.publish(SPT_SCHEDULE_TOPIC, "", true);
+        }
+      }
+      if (persist)
+      {
+        paramFileObj = LittleFS.open(F(PARAMS_FILENAME), "w");
+        saved = (paramFileObj.write((uint8_t *)&opParams, sizeof(opParams)) == sizeof(opParams));
+        paramFileObj.close();
+      }
+      sprintf(msg, "{\"result\": \"ok\", \"fields\": \"%d\", \"persisted\": \"%d\"}", fields, saved);
     }
     else
-      Serial.println(F("Invalid valveState requested"));
+      sprintf(msg, "{\"result\": \"rejected\", \"error\": \"%s\"}", err);
+    mqttClient.publish(SET_PARAMS_TOPIC, msg, false);
+    Serial.printf("%s setParams > MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SET_PARAMS_TOPIC, msg);
   }
   if (strstr(topic, "reportParams")) // report opParams
   {
     cmdValid = true;
-    sprintf(msg, "{\"valveState\": \"%d\", \"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", \"idlePublishInterval\": \"%d\", "
-                 "\"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", \"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\"}\n\n",
-            valveState, opParams.version, opParams.valveInstalled, opParams.pressureInstalled, opParams.idlePublishInterval, opParams.minPublishInterval,
-            opParams.sensorReadInterval, opParams.sptPressureDrop, opParams.sptDemandWaterPercentDrop, opParams.sptDuration);
+    formatParams(msg);
     mqttClient.publish(REPORT_TOPIC, msg, true);
     Serial.printf("%s reportParams > MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), REPORT_TOPIC, msg);
   }
   if (strstr(topic, "defaultParams")) // set params to firmware defaults without file write
   {
     cmdValid = true;
-    strcpy(opParams.version, VERSION);
-    opParams.valveInstalled = INITIAL_VALVE_INSTALLED_STATE;
-    opParams.pressureInstalled = INITIAL_PRESSURE_SENSOR_INSTALLED_STATE;
-    opParams.idlePublishInterval = DEFAULT_IDLE_PUBLISH_INTERVAL_MS;
-    opParams.minPublishInterval = DEFAULT_MIN_PUBLISH_INTERVAL_MS;
-    opParams.sensorReadInterval = DEFAULT_SENSOR_READ_INTERVAL_MS;
-    opParams.sptPressureDrop = (float)DEFAULT_SPT_REPORT_PSI_DROP;
-    opParams.sptDemandWaterPercentDrop = (float)DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP;
-    opParams.sptDuration = DEFAULT_SPT_TEST_DURATION_MINUTES;
+    setDefaultParams();
     Serial.println(F("Parameters set to default firmware values\n"));
   }
   if (strstr(topic, "readParams")) // reload params from file without reboot or file write
@@ -644,10 +3261,8 @@ void callback(char *topic, byte *payload, unsigned int length)
     if (paramFileObj.readBytes((char *)&opParams, sizeof(opParams)) > 0)
     {
       Serial.printf("Parameters loaded from file %s \n", PARAMS_FILENAME);
-      Serial.printf("{\"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", \"idlePublishInterval\": \"%d\", "
-                    "\"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", \"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\"}\n\n",
-                    opParams.version, opParams.valveInstalled, opParams.pressureInstalled, opParams.idlePublishInterval, opParams.minPublishInterval,
-                    opParams.sensorReadInterval, opParams.sptPressureDrop, opParams.sptDemandWaterPercentDrop, opParams.sptDuration);
+      formatParams(msg);
+      Serial.printf("%s", msg);
     }
     else
       Serial.println(F("Unable to read parameters from file"));
@@ -688,7 +3303,9 @@ void callback(char *topic, byte *payload, unsigned int length)
   {
     cmdValid = true;
     sprintf(msg, "{\"commands\" : \"valveInstalled, pressureInstalled, valveState, idlePublishInterval, minPublishInterval, sensorReadInterval, "
-                 "sptPressureDrop, sptDemandWaterPercentDrop, sptDuration, sptStart, reportParams, defaultParams, readParams, writeParams, deleteParams, reboot, help\"}");
+                 "sptPressureDrop, sptDemandWaterPercentDrop, sptDuration, adaptiveSampling, fastReadInterval, slowReadInterval, adaptiveSlopeThreshold, "
+                 "publishMode, sdtDeviation, passiveStartHour, passiveEndHour, sptAutoSchedule, sptThermalMode, sptThermalCoeff, valveExerciseDays, valveExerciseMode, "
+                 "sptStart, valveExercise, valveHealth, leakSensorAdd, leakSensorDel, leakSensorList, demandReport, fixtureReport, events, ping, mqttStats, setParams, reportParams, defaultParams, readParams, writeParams, deleteParams, reboot, help\"}");
     mqttClient.publish(HELP_TOPIC, msg);
     Serial.printf("%s help > MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), HELP_TOPIC, msg);
   }
@@ -699,6 +3316,144 @@ void callback(char *topic, byte *payload, unsigned int length)
   msg[0] = (char)NULL; // clear msg
 }
 
+//   ***************************
+//   **   rtcSnapshotSave()   **
+//   ***************************
+
+// Copies the runtime state to RTC user memory - survives reboot, watchdog & exception resets but not power loss
+void rtcSnapshotSave()
+{
+  lastRtcSave = millis();
+  rtcSnap.magic = RTC_SNAPSHOT_MAGIC;
+  if (millis() > RTC_STABLE_RUN_MS)
+    rtcSnap.warmRestarts = 0;
+  rtcSnap.savedAt = now();
+  rtcSnap.sptDeadline = (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0) ? sptDeadline : 0;
+  rtcSnap.sptBeginningPressure = sptBeginningPressure;
+  rtcSnap.medianPressure = medianPressure;
+  memcpy(rtcSnap.sampleRaw, sampleRaw, sizeof(sampleRaw));
+  rtcSnap.filteredPressure = filteredPressure;
+  rtcSnap.pressureBaseline = pressureBaseline;
+  rtcSnap.psiTminus1 = psiTminus1;
+  rtcSnap.psiTminus2 = psiTminus2;
+  rtcSnap.sampleCount = sampleCount;
+  rtcSnap.sptConsecAborts = sptConsecAborts;
+  rtcSnap.preSptIdlePublishInterval = pre_spt_idlePublishInterval;
+  rtcSnap.preSptMinPublishInterval = pre_spt_minPublishInterval;
+  rtcSnap.mqttMsgs = mqttClient.msgs;
+  rtcSnap.mqttBytes = mqttClient.bytes;
+  rtcSnap.mqttConnects = mqttStats.connects;
+  rtcSnap.valveState = valveState;
+  rtcSnap.valvePreSPT = valvePreSPT;
+  if (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0)
+    rtcSnap.sptStatus = 1;
+  else if (strcmp(sptDataStatus, SPT_DATA_VALID) == 0)
+    rtcSnap.sptStatus = 2;
+  else if (strcmp(sptDataStatus, SPT_DATA_ABORTED) == 0)
+    rtcSnap.sptStatus = 3;
+  else
+    rtcSnap.sptStatus = 0;
+  rtcSnap.crc = crc32(&rtcSnap, offsetof(RtcSnapshot, crc));
+  ESP.rtcUserMemoryWrite(RTC_SNAPSHOT_OFFSET, (uint32_t *)&rtcSnap, sizeof(rtcSnap));
+}
+
+//   ***************************
+//   **     rtcLoad()         **
+//   ***************************
+
+// Reads the breadcrumb & snapshot left by the previous run - only trusted after a warm reset with a matching CRC
+void rtcLoad()
+{
+  uint32_t reason = ESP.getResetInfoPtr()->reason;
+  boolean warm = (reason == REASON_WDT_RST) || (reason == REASON_EXCEPTION_RST) || (reason == REASON_SOFT_WDT_RST) ||
+                 (reason == REASON_SOFT_RESTART) || (reason == REASON_EXT_SYS_RST);
+  uint32_t crumb[2];
+  ESP.rtcUserMemoryRead(RTC_BREADCRUMB_OFFSET, crumb, sizeof(crumb));
+  if (warm && (crumb[0] == ~crumb[1]) && (crumb[0] <= BC_IDLE))
+    rtcBreadcrumbAtReset = crumb[0];
+
+  ESP.rtcUserMemoryRead(RTC_SNAPSHOT_OFFSET, (uint32_t *)&rtcSnap, sizeof(rtcSnap));
+  rtcSnapValid = warm && (rtcSnap.magic == RTC_SNAPSHOT_MAGIC) && (rtcSnap.crc == crc32(&rtcSnap, offsetof(RtcSnapshot, crc)));
+  if (rtcSnapValid)
+    rtcWarmRestarts = ++rtcSnap.warmRestarts;
+  if (rtcWarmRestarts > RTC_MAX_WARM_RESTARTS)
+  {
+    rtcSnapDiscarded = true;                         // start clean - the count restarts with the next snapshot
+    rtcSnapValid = false;
+    Serial.printf("%u warm restarts in a row - RTC snapshot discarded\n", rtcWarmRestarts);
+  }
+  if (!rtcSnapValid)
+    memset(&rtcSnap, 0, sizeof(rtcSnap));
+  Serial.printf("Reset reason: %s, breadcrumb %d, RTC snapshot %s\n", ESP.getResetReason().c_str(), rtcBreadcrumbAtReset,
+                rtcSnapValid ? "valid" : "not valid");
+  rtcBreadcrumb(BC_SETUP);
+}
+
+//   ***************************
+//   **     rtcResume()       **
+//   ***************************
+
+// Puts the saved runtime state back after a warm reset - an SPT still in its window continues, one that ran out is aborted
+void rtcResume()
+{
+  if (!rtcSnapValid)
+    return;
+  memcpy(sampleRaw, rtcSnap.sampleRaw, sizeof(sampleRaw));
+  sampleCount = rtcSnap.sampleCount;
+  filteredPressure = rtcSnap.filteredPressure;
+  pressureBaseline = rtcSnap.pressureBaseline;
+  baselineMs = millis();
+  medianPressure = rtcSnap.medianPressure;
+  psiTminus1 = rtcSnap.psiTminus1;
+  psiTminus2 = rtcSnap.psiTminus2;
+  sptConsecAborts = rtcSnap.sptConsecAborts;
+  mqttClient.msgs = rtcSnap.mqttMsgs;
+  mqttClient.bytes = rtcSnap.mqttBytes;
+  mqttStats.connects = rtcSnap.mqttConnects;
+  valveState = rtcSnap.valveState;
+  if (rtcSnap.sptStatus == 2)
+    strcpy(sptDataStatus, SPT_DATA_VALID);
+  else if (rtcSnap.sptStatus == 3)
+    strcpy(sptDataStatus, SPT_DATA_ABORTED);
+
+  if constexpr (HAS_SPT)
+  {
+    if ((rtcSnap.sptStatus == 1) && (rtcSnap.sptDeadline != 0))
+    {
+      valvePreSPT = rtcSnap.valvePreSPT;
+      pre_spt_idlePublishInterval = rtcSnap.preSptIdlePublishInterval;
+      pre_spt_minPublishInterval = rtcSnap.preSptMinPublishInterval;
+      sptBeginningPressure = rtcSnap.sptBeginningPressure;
+      if ((time_t)rtcSnap.sptDeadline > now() + RTC_SPT_RESUME_MIN_SECS)
+      {
+        strcpy(sptDataStatus, SPT_DATA_IN_PROCESS);
+        opParams.idlePublishInterval = 15000;                      // same reporting as sptStart()
+        opParams.minPublishInterval = SPT_MIN_PUBLISH_INTERVAL_MS;
+        valveState = CLOSE_VALVE;                                  // the valve held its position through the reset
+        memset(&sptThermal, 0, sizeof(sptThermal));
+        sptThermal.active = true;                                  // trace restarts - it was not worth the RTC space
+        sptDeadline = rtcSnap.sptDeadline;
+        setEvent(sptEnd, sptDeadline);
+        rtcSptAction = 1;
+        Serial.printf("SPT resumed - %ld secs left\n", (long)(sptDeadline - now()));
+      }
+      else
+      {
+        strcpy(sptDataStatus, SPT_DATA_ABORTED);
+        sptConsecAborts++;
+        valveState = valvePreSPT;
+        applyValveState(valvePreSPT, false);
+        journalAppend(EVENT_SPT_ABORT, 2, 0, 0);
+        rtcSptAction = 2;
+        Serial.println(F("SPT ended during the restart - aborted"));
+        if (opParams.sptAutoSchedule == 1)
+          sptScheduleNext(true);
+      }
+    }
+  }
+  Serial.printf("Runtime state restored from RTC memory (warm restart %u)\n", rtcSnap.warmRestarts);
+}
+
 //   ***********************
 //   **     setup()       **
 //   ***********************
@@ -708,6 +3463,10 @@ void setup()
   Serial.begin(115200);
   delay(500);
   Serial.printf("\n\n\nWater Main Controller %s\n\n", VERSION);
+  if constexpr (BUILD_PROFILE == PROFILE_SENSOR_ONLY)
+    Serial.println(F("Build profile: SENSOR ONLY"));
+  else if constexpr (BUILD_PROFILE == PROFILE_VALVE_ONLY)
+    Serial.println(F("Build profile: VALVE ONLY"));
 
   if (DEBUG_SPT)
     Serial.println(F(">>>> DEBUG_SPT IS ENABLED!! <<<<"));
@@ -716,14 +3475,18 @@ void setup()
   strcpy(sptDataStatus, SPT_DATA_INVALID);
 
   // set GPIOs
-  pinMode(PIN_VALVE_ON_INDICATOR, INPUT);
-  pinMode(PIN_VALVE_OFF_INDICATOR, INPUT);
-  pinMode(PIN_VALVE_ON, OUTPUT);
-  pinMode(PIN_VALVE_OFF, OUTPUT);
-  digitalWrite(PIN_VALVE_ON, LOW);
-  digitalWrite(PIN_VALVE_OFF, LOW);
+  if constexpr (HAS_VALVE)
+  {
+    pinMode(PIN_VALVE_ON_INDICATOR, INPUT);
+    pinMode(PIN_VALVE_OFF_INDICATOR, INPUT);
+    pinMode(PIN_VALVE_ON, OUTPUT);
+    pinMode(PIN_VALVE_OFF, OUTPUT);
+    digitalWrite(PIN_VALVE_ON, LOW);
+    digitalWrite(PIN_VALVE_OFF, LOW);
+  }
 
-  Wire.begin(PIN_SDA, PIN_SCL);
+  if constexpr (HAS_PRESSURE)
+    Wire.begin(PIN_SDA, PIN_SCL);
 
   setup_wifi();
 
@@ -738,7 +3501,8 @@ void setup()
   Serial.printf("\nLocal time: %s\n\n", lastBoot);
 
   mqttClient.setBufferSize(MSG_BUFFER_SIZE);
-  mqttClient.setServer(MQTT_SERVER, 1883);
+  espClient.setTimeout(MQTT_CONNECT_TIMEOUT_MS);
+  mqttClient.setSocketTimeout(MQTT_SOCKET_TIMEOUT_SECS);
   mqttClient.setCallback(callback);
   lastReconnectAttempt = 0;
 
@@ -763,22 +3527,26 @@ void setup()
   }
   Serial.println("---------------------------------\n");
 
+  rtcLoad();
+  journalOpen();
+  journalAppend(EVENT_BOOT, ESP.getResetInfoPtr()->reason, rtcBreadcrumbAtReset, 0);
+  if (rtcSnapDiscarded)
+    journalAppend(EVENT_RTC_DISCARDED, 0, rtcWarmRestarts, 0);
+
   if (LittleFS.exists(F(PARAMS_FILENAME))) // if file exists
   {
     paramFileObj = LittleFS.open(F(PARAMS_FILENAME), "r+");
     if (paramFileObj.readBytes((char *)&opParams, sizeof(opParams)) == sizeof(opParams))
     {
       Serial.println(F("Parameters loaded from file:"));
-      Serial.printf("{\"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", \"idlePublishInterval\": \"%d\", "
-                    "\"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", \"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\"}\n\n",
-                    opParams.version, opParams.valveInstalled, opParams.pressureInstalled, opParams.idlePublishInterval, opParams.minPublishInterval,
-                    opParams.sensorReadInterval, opParams.sptPressureDrop, opParams.sptDemandWaterPercentDrop, opParams.sptDuration);
-      if (opParams.valveInstalled == 1)
+      formatParams(msg);
+      Serial.printf("%s", msg);
+      if (hasValve())
         Serial.println(F("Valve configuration: INSTALLED\n"));
       else
         Serial.println(F("Valve configuration: NOT INSTALLED\n"));
 
-      if (opParams.pressureInstalled == 1)
+      if (hasPressure())
         Serial.println(F("Pressure sensor configuration: INSTALLED\n"));
       else
         Serial.println(F("pressure sensor configuration: NOT INSTALLED\n"));
@@ -786,15 +3554,7 @@ void setup()
     else
     {
       Serial.println(F("Parameters file read error.  Using default values."));
-      strcpy(opParams.version, VERSION);
-      opParams.valveInstalled = INITIAL_VALVE_INSTALLED_STATE;
-      opParams.pressureInstalled = INITIAL_PRESSURE_SENSOR_INSTALLED_STATE;
-      opParams.idlePublishInterval = DEFAULT_IDLE_PUBLISH_INTERVAL_MS;
-      opParams.minPublishInterval = DEFAULT_MIN_PUBLISH_INTERVAL_MS;
-      opParams.sensorReadInterval = DEFAULT_SENSOR_READ_INTERVAL_MS;
-      opParams.sptPressureDrop = (float)DEFAULT_SPT_REPORT_PSI_DROP;
-      opParams.sptDemandWaterPercentDrop = (float)DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP;
-      opParams.sptDuration = DEFAULT_SPT_TEST_DURATION_MINUTES;
+      setDefaultParams();
       if (paramFileObj.write((uint8_t *)&opParams, sizeof(opParams)) > 0)
         Serial.printf("Parameters file re-created: %s, %d bytes\n", paramFileObj.name(), paramFileObj.size());
       else
@@ -805,15 +3565,7 @@ void setup()
   else
   { // fill it with default values
     Serial.println(F("No parameters file detected. Using default values."));
-    strcpy(opParams.version, VERSION);
-    opParams.valveInstalled = INITIAL_VALVE_INSTALLED_STATE;
-    opParams.pressureInstalled = INITIAL_PRESSURE_SENSOR_INSTALLED_STATE;
-    opParams.idlePublishInterval = DEFAULT_IDLE_PUBLISH_INTERVAL_MS;
-    opParams.minPublishInterval = DEFAULT_MIN_PUBLISH_INTERVAL_MS;
-    opParams.sensorReadInterval = DEFAULT_SENSOR_READ_INTERVAL_MS;
-    opParams.sptPressureDrop = (float)DEFAULT_SPT_REPORT_PSI_DROP;
-    opParams.sptDemandWaterPercentDrop = (float)DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP;
-    opParams.sptDuration = DEFAULT_SPT_TEST_DURATION_MINUTES;
+    setDefaultParams();
 
     paramFileObj = LittleFS.open(F(PARAMS_FILENAME), "w+");
     if (paramFileObj.write((uint8_t *)&opParams, sizeof(opParams)) > 0)
@@ -822,6 +3574,52 @@ void setup()
       Serial.println(F("Parameters file creation error"));
     paramFileObj.close();
   }
+
+  // Learned demand histogram for the SPT scheduler
+  if (LittleFS.exists(F(DEMAND_HIST_FILENAME)))
+  {
+    File histFileObj = LittleFS.open(F(DEMAND_HIST_FILENAME), "r");
+    if (histFileObj.readBytes((char *)demandHist, sizeof(demandHist)) != sizeof(demandHist))
+    {
+      Serial.println(F("Demand histogram file read error.  Learning starts over."));
+      memset(demandHist, 0, sizeof(demandHist));
+    }
+    histFileObj.close();
+  }
+  if constexpr (HAS_SPT)
+  {
+    if (opParams.sptAutoSchedule == 1)
+      sptScheduleNext(false);
+  }
+
+  // Valve travel time trend
+  if constexpr (HAS_VALVE)
+  {
+    File healthFileObj = LittleFS.open(F(VALVE_HEALTH_FILENAME), "r");
+    if ((!healthFileObj) || (healthFileObj.readBytes((char *)&valveHealth, sizeof(valveHealth)) != sizeof(valveHealth)) ||
+        (valveHealth.magic != VALVE_HEALTH_MAGIC))
+    {
+      Serial.println(F("No valve health trend found.  Learning starts over."));
+      memset(&valveHealth, 0, sizeof(valveHealth));
+      valveHealth.magic = VALVE_HEALTH_MAGIC;
+    }
+    healthFileObj.close();
+  }
+
+  // Past SPT traces for fitting the thermal coefficient
+  if constexpr (HAS_SPT)
+  {
+    File thermFileObj = LittleFS.open(F(SPT_THERMAL_FILENAME), "r");
+    if ((!thermFileObj) || (thermFileObj.readBytes((char *)&sptThermalHist, sizeof(sptThermalHist)) != sizeof(sptThermalHist)) ||
+        (sptThermalHist.magic != SPT_THERMAL_MAGIC))
+    {
+      memset(&sptThermalHist, 0, sizeof(sptThermalHist));
+      sptThermalHist.magic = SPT_THERMAL_MAGIC;
+    }
+    thermFileObj.close();
+  }
+
+  rtcResume();
 }
 
 //   ***********************
@@ -831,83 +3629,116 @@ void setup()
 void loop()
 {
 
+  rtcBreadcrumb(BC_EVENTS);
   ArduinoOTA.handle();
   events(); // exececute ezTime events i.e. Static Pressure Test
 
+  rtcBreadcrumb(BC_MQTT);
   if (!mqttClient.connected())
   {
+    if (mqttWasConnected)   // connection just dropped - start over from the preferred broker
+    {
+      mqttWasConnected = false;
+      postConnectStage = 0;
+      mqttBrokerIndex = 0;
+      mqttBrokerFailures = 0;
+      mqttBackoff = MQTT_BACKOFF_MIN_MS;
+      mqttRetryDelay = 0;
+    }
     mqttNow = millis();
-    if (mqttNow - lastReconnectAttempt > 1000)
+    if (mqttNow - lastReconnectAttempt >= mqttRetryDelay)
     {
       Serial.printf("[%s] Waiting for MQTT...\n", myTZ.dateTime(RFC3339).c_str());
       lastReconnectAttempt = mqttNow;
       // Attempt to reconnect
-      if (reconnect())
-      {
-        lastReconnectAttempt = 0;
-      }
+      mqttWasConnected = reconnect();
     }
   }
   else
   {
     // Client connected
     mqttClient.loop();
+    if (postConnectStage != 0)
+      postConnectSync();
+    else if (journalQuery.active)
+      journalQueryPage();
+    else if (millis() - mqttStats.lastReportMs >= MQTT_STATS_INTERVAL_MS)
+      mqttStatsPublish();
+  }
+
+  // Persist learned demand at most once an hour
+  if (demandHistDirty && (myTZ.hour() != demandHistSavedHour))
+  {
+    saveDemandHist();
+    demandHistSavedHour = myTZ.hour();
+  }
+
+  // Valve exercise
+  rtcBreadcrumb(BC_VALVE);
+  if constexpr (HAS_VALVE)
+  {
+    if (valveResync.active)
+      valveResyncRun();
+    else if (valveExercise.stage != 0)
+      valveExerciseRun();
+    else if (hasValve() && (millis() - lastExerciseCheck >= VALVE_EXERCISE_CHECK_MS))
+    {
+      lastExerciseCheck = millis();
+      if (valveExerciseDue())
+        valveExerciseStart();
+    }
   }
 
   // Sync valve state
-  if ( (opParams.valveInstalled == 1) && (!DEBUG_SPT) )
+  if constexpr (HAS_VALVE)
   {
-    // Periodically check to sync software valveState with actual indicator inputs in case manual valve switch was used
-    //  - this polling method used because manual override may result in half on/off state for an unknown amount of time
-    lastValveSyncNow = millis();
-    if ((unsigned long)(lastValveSyncNow - lastValveSync) > (unsigned long)VALVE_SYNC_INTERVAL_MS)
+    if ( hasValve() && (!DEBUG_SPT) && (valveExercise.stage == 0) && (!valveResync.active) )
     {
-      if ((digitalRead(PIN_VALVE_ON_INDICATOR) == LOW) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW)) // valve left half open/closed
-      {
-        Serial.println(F("Actual valve state cannot be determined.  Setting valve to defined VALVE_ERROR_DEFAULT"));
-        mqttClient.publish(LAST_VALVE_STATE_UNK_TOPIC, myTZ.dateTime(RFC3339).c_str(), true);
-        Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), LAST_VALVE_STATE_UNK_TOPIC, myTZ.dateTime(RFC3339).c_str());
-        valveState = VALVE_ERROR_DEFAULT;
-        applyValveState(VALVE_ERROR_DEFAULT, false); // this can be a loop if valve is half open/closed, so do not write to flash
-        Serial.println(F("To protect flash memory, valveState not saved"));
-      }
-      else
+      // Periodically check to sync software valveState with actual indicator inputs in case manual valve switch was used
+      //  - this polling method used because manual override may result in half on/off state for an unknown amount of time
+      lastValveSyncNow = millis();
+      if ((unsigned long)(lastValveSyncNow - lastValveSync) > (unsigned long)VALVE_SYNC_INTERVAL_MS)
       {
-        if ((digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH) && (valveState != 1))
+        if ((digitalRead(PIN_VALVE_ON_INDICATOR) == LOW) && (digitalRead(PIN_VALVE_OFF_INDICATOR) == LOW)) // valve left half open/closed
         {
-          Serial.println(F("valveState CONFLICT DETECTED - syncing to actual: valveState=1"));
-          valveState = 1;
-          applyValveState(valveState, true);
+          Serial.println(F("Actual valve state cannot be determined.  Setting valve to defined VALVE_ERROR_DEFAULT"));
+          mqttClient.publish(LAST_VALVE_STATE_UNK_TOPIC, myTZ.dateTime(RFC3339).c_str(), true);
+          if (!valveUnknownJournaled)                  // once per half open spell, not every sync
+            journalAppend(EVENT_VALVE_UNK, 0, 0, 0);
+          valveUnknownJournaled = true;
+          Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), LAST_VALVE_STATE_UNK_TOPIC, myTZ.dateTime(RFC3339).c_str());
+          valveState = VALVE_ERROR_DEFAULT;
+          applyValveState(VALVE_ERROR_DEFAULT, false); // this can be a loop if valve is half open/closed, so do not write to flash
+          Serial.println(F("To protect flash memory, valveState not saved"));
         }
-        if ((digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH) && (valveState != 0))
+        else
         {
-          Serial.println(F("valveState CONFLICT DETECTED - syncing to actual: valveState=0"));
-          valveState = 0;
-          applyValveState(valveState, true);
+          valveUnknownJournaled = false;
+          if ((digitalRead(PIN_VALVE_ON_INDICATOR) == HIGH) && (valveState != 1))
+          {
+            Serial.println(F("valveState CONFLICT DETECTED - syncing to actual: valveState=1"));
+            valveState = 1;
+            applyValveState(valveState, true);
+          }
+          if ((digitalRead(PIN_VALVE_OFF_INDICATOR) == HIGH) && (valveState != 0))
+          {
+            Serial.println(F("valveState CONFLICT DETECTED - syncing to actual: valveState=0"));
+            valveState = 0;
+            applyValveState(valveState, true);
+          }
         }
+        lastValveSync = millis();
       }
-      lastValveSync = millis();
     }
   }
 
   // Sanity check to prevent MQTT flooding - reset ALL to defaults if parameters seem corrupted
-  if ((opParams.idlePublishInterval < DEFAULT_MIN_PUBLISH_INTERVAL_MS) || (opParams.minPublishInterval < DEFAULT_SENSOR_READ_INTERVAL_MS) 
-       || (opParams.sensorReadInterval < 3) || (opParams.sptPressureDrop <= (float).2) || (opParams.sptDuration < 1))
+  if (!paramsValid(opParams))
   {
     Serial.printf("Parameters loaded from file %s \n", PARAMS_FILENAME);
-    Serial.printf("{\"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", \"idlePublishInterval\": \"%d\", "
-                  "\"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", \"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\"}\n\n",
-                  opParams.version, opParams.valveInstalled, opParams.pressureInstalled, opParams.idlePublishInterval, opParams.minPublishInterval,
-                  opParams.sensorReadInterval, opParams.sptPressureDrop, opParams.sptDemandWaterPercentDrop, opParams.sptDuration);
-    strcpy(opParams.version, VERSION);
-    opParams.valveInstalled = INITIAL_VALVE_INSTALLED_STATE;
-    opParams.pressureInstalled = INITIAL_PRESSURE_SENSOR_INSTALLED_STATE;
-    opParams.idlePublishInterval = DEFAULT_IDLE_PUBLISH_INTERVAL_MS;
-    opParams.minPublishInterval = DEFAULT_MIN_PUBLISH_INTERVAL_MS;
-    opParams.sensorReadInterval = DEFAULT_SENSOR_READ_INTERVAL_MS;
-    opParams.sptPressureDrop = (float)DEFAULT_SPT_REPORT_PSI_DROP;
-    opParams.sptDemandWaterPercentDrop = (float)DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP;
-    opParams.sptDuration = DEFAULT_SPT_TEST_DURATION_MINUTES;
+    formatParams(msg);
+    Serial.printf("%s", msg);
+    setDefaultParams();
     Serial.println(F("PARAMETER SANITY CHECK FAILED.  All parameters reset to defaults. "));
     paramFileObj = LittleFS.open(F(PARAMS_FILENAME), "w+");
     if (paramFileObj.write((uint8_t *)&opParams, sizeof(opParams)) > 0)
@@ -919,113 +3750,122 @@ void loop()
 
 
   // Read sensor
-  if (opParams.pressureInstalled == 1)
+  rtcBreadcrumb(BC_SENSOR);
+  if constexpr (HAS_PRESSURE)
   {
-    sensorStatus = 0xFF; // set to non-zero for initial while() test
-    sensorReadNow = millis();
-    if ((unsigned long)(sensorReadNow - lastRead) > opParams.sensorReadInterval)
+    if (hasPressure())
     {
-      lastRead = millis();
-      while (sensorStatus != 0) // continue reading until valid
+      sensorStatus = 0xFF; // set to non-zero for initial while() test
+      sensorReadNow = millis();
+      if ((unsigned long)(sensorReadNow - lastRead) > activeReadInterval)
       {
-        Wire.requestFrom(I2C_ADDR, 4); // request 4 bytes  - if optional 3rd argument false = don't share i2c bus
-        int n = Wire.available();
-        if (n == 4)
-        {
-          sensorStatus = 0;  // set to zero to exit while loop when read is successful
-          uint16_t rawP; // pressure data from sensor
-          uint16_t rawT; // temperature data from sensor
-
-          rawP = (uint16_t)Wire.read(); // upper 8 bits
-          rawP <<= 8;
-          rawP |= (uint16_t)Wire.read(); // lower 8 bits
-          rawT = (uint16_t)Wire.read();  // upper 8 bits
-          rawT <<= 8;
-          rawT |= (uint16_t)Wire.read(); // lower 8 bits
-
-          sensorStatus = rawP >> 14; // The status is 0, 1, 2 or 3
-          rawP &= 0x3FFF;            // keep 14 bits, remove status bits
-
-          rawT >>= 5; // the lowest 5 bits are not used
-
-          psiTminus0 = ((rawP - 1000.0) / (15000.0 - 1000.0)) * MAX_PRESSURE;
-          temperature = ((rawT - 512.0) / (1075.0 - 512.0)) * 55.0;
-        }
-        else
+        lastRead = millis();
+        while (sensorStatus != 0) // continue reading until valid
         {
-          lastPressErrReportNow = millis();
-          if ((unsigned long)(lastPressErrReportNow - lastPressErrReport) > (unsigned long)PRESSURE_SENSOR_FAULT_PUB_INTERVAL_MS)
+          sensorStatus = readSensor();
+          if (sensorStatus == 0)
+            processPressureSample(psiTminus0, lastRead);
+          else if (sensorStatus == 0xFF)
           {
-            Serial.println(F("Error reading pressure sensor"));
-            mqttClient.publish(PRESSURE_SENSOR_FAULT_TOPIC, myTZ.dateTime(RFC3339).c_str(), true);
-            Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PRESSURE_SENSOR_FAULT_TOPIC, myTZ.dateTime(RFC3339).c_str());
-            lastPressErrReport = millis();
+            lastPressErrReportNow = millis();
+            if ((unsigned long)(lastPressErrReportNow - lastPressErrReport) > (unsigned long)PRESSURE_SENSOR_FAULT_PUB_INTERVAL_MS)
+            {
+              Serial.println(F("Error reading pressure sensor"));
+              mqttClient.publish(PRESSURE_SENSOR_FAULT_TOPIC, myTZ.dateTime(RFC3339).c_str(), true);
+              Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PRESSURE_SENSOR_FAULT_TOPIC, myTZ.dateTime(RFC3339).c_str());
+              journalAppend(EVENT_PRESSURE_FAULT, 0, 0, 0);
+              lastPressErrReport = millis();
+            }
+            break;   // lastRead was just set, so the retry waits activeReadInterval without stalling loop()
           }
-          while ((millis() - lastPressErrReportNow) < opParams.sensorReadInterval); // prevent cycling too fast
-          break;
         }
       }
-    }
 
-    lastPublishNow = millis();
-    if (  ( ((unsigned long)(lastPublishNow - lastPublish) > opParams.idlePublishInterval) ||
-        ((fabs(psiTminus1 - psiTminus0) > opParams.sptPressureDrop) && (lastPublishNow - lastPublish >= opParams.minPublishInterval)) ) &&
-        mqttClient.connected()  )
-    {
-      // use MEDIAN of last three readings to filter glitches - psiTminus0 is latest reading, psiTminus2 is oldest
-      // MEDIAN is the middle of the last three readings - not the average
-      if ((psiTminus1 != 0) && (psiTminus2 != 0))
+      rtcBreadcrumb(BC_PUBLISH);
+      lastPublishNow = millis();
+      if ((opParams.publishMode == 1) && sdt.pending && mqttClient.connected() &&
+          ((unsigned long)(lastPublishNow - lastPublish) >= SDT_MIN_EMIT_INTERVAL_MS))
       {
-        if ((psiTminus1 > psiTminus2 && psiTminus2 > psiTminus0) || (psiTminus0 > psiTminus2 && psiTminus2 > psiTminus1))
-          medianPressure = psiTminus2;
-        if ((psiTminus2 > psiTminus1 && psiTminus1 > psiTminus0) || (psiTminus0 > psiTminus1 && psiTminus1 > psiTminus2))
-          medianPressure = psiTminus1;
-        if ((psiTminus2 > psiTminus0 && psiTminus0 > psiTminus1) || (psiTminus1 > psiTminus0 && psiTminus0 > psiTminus2))
-          medianPressure = psiTminus0;
+        sprintf(msg, "%.2f", sdt.pendingP);
+        mqttClient.publish(PRESSURE_TOPIC, msg);
+        Serial.printf("\n%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PRESSURE_TOPIC, msg);
+        sprintf(msg, "%.2f", (PREFER_FAHRENHEIT == 1) ? (1.8 * temperature + 32) : temperature);
+        mqttClient.publish(TEMPERATURE_TOPIC, msg);
+        Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), TEMPERATURE_TOPIC, msg);
+        lastPublish = millis();
+        sdt.pending = false;
       }
-      else
+      else if ( (opParams.publishMode != 1) &&
+          ( ((unsigned long)(lastPublishNow - lastPublish) > opParams.idlePublishInterval) ||
+          ((fabs(psiTminus1 - psiTminus0) > opParams.sptPressureDrop) && (lastPublishNow - lastPublish >= opParams.minPublishInterval)) ) &&
+          mqttClient.connected()  )
       {
-        medianPressure = psiTminus0;
+        // use MEDIAN of last three readings to filter glitches - psiTminus0 is latest reading, psiTminus2 is oldest
+        // MEDIAN is the middle of the last three readings - not the average
+        if ((psiTminus1 != 0) && (psiTminus2 != 0))
+        {
+          if ((psiTminus1 > psiTminus2 && psiTminus2 > psiTminus0) || (psiTminus0 > psiTminus2 && psiTminus2 > psiTminus1))
+            medianPressure = psiTminus2;
+          if ((psiTminus2 > psiTminus1 && psiTminus1 > psiTminus0) || (psiTminus0 > psiTminus1 && psiTminus1 > psiTminus2))
+            medianPressure = psiTminus1;
+          if ((psiTminus2 > psiTminus0 && psiTminus0 > psiTminus1) || (psiTminus1 > psiTminus0 && psiTminus0 > psiTminus2))
+            medianPressure = psiTminus0;
+        }
+        else
+        {
+          medianPressure = psiTminus0;
+        }
+        sprintf(msg, "%.2f", medianPressure);
+        mqttClient.publish(PRESSURE_TOPIC, msg);
+        Serial.printf("\n%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PRESSURE_TOPIC, msg);
+        if (PREFER_FAHRENHEIT == 1)
+          temperature = (1.8 * temperature + 32);
+        sprintf(msg, "%.2f", temperature);
+        mqttClient.publish(TEMPERATURE_TOPIC, msg);
+        Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), TEMPERATURE_TOPIC, msg);
+        lastPublish = millis();
+        psiTminus2 = psiTminus1; // rotate queue
+        psiTminus1 = psiTminus0;
       }
-      sprintf(msg, "%.2f", medianPressure);
-      mqttClient.publish(PRESSURE_TOPIC, msg);
-      Serial.printf("\n%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), PRESSURE_TOPIC, msg);
-      if (PREFER_FAHRENHEIT == 1)
-        temperature = (1.8 * temperature + 32);
-      sprintf(msg, "%.2f", temperature);
-      mqttClient.publish(TEMPERATURE_TOPIC, msg);
-      Serial.printf("%s MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), TEMPERATURE_TOPIC, msg);
-      lastPublish = millis();
-      psiTminus2 = psiTminus1; // rotate queue
-      psiTminus1 = psiTminus0;
-    }
-
-    // automatically open valve if demand pressure drop is met during SPT
-    if (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0)
-    {
-      if (fabs(sptBeginningPressure - medianPressure) > (sptBeginningPressure * DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP/100))
-      {       
-        deleteEvent(sptEnd);  // delete event from ezTime event handler
+
+      // automatically open valve if demand pressure drop is met during SPT
+      rtcBreadcrumb(BC_SPT);
+      if constexpr (HAS_SPT)
+      {
+        if (strcmp(sptDataStatus, SPT_DATA_IN_PROCESS) == 0)
+        {
+          if (fabs(sptBeginningPressure - medianPressure) > (sptBeginningPressure * DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP/100))
+          {       
+            deleteEvent(sptEnd);  // delete event from ezTime event handler
         
-        // set status to ABORTED
-        strcpy(sptDataStatus, SPT_DATA_ABORTED);
-        sprintf(msg, "%s", sptDataStatus);
-        mqttClient.publish(SPT_DATA_STATUS_TOPIC, msg, true);
-        Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC, msg);
+            // set status to ABORTED
+            strcpy(sptDataStatus, SPT_DATA_ABORTED);
+            sprintf(msg, "%s", sptDataStatus);
+            mqttClient.publish(SPT_DATA_STATUS_TOPIC, msg, true);
+            Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC, msg);
         
-        // report consecutive aborts attribute
-        sptConsecAborts++;
-        sprintf(msg, "{\"consec_aborts\": \"%d\"}", sptConsecAborts);
-        mqttClient.publish(SPT_DATA_STATUS_TOPIC"/attributes", msg, true);  
-        Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC"/attributes", msg);
-
-        // Restore previous states
-        opParams.idlePublishInterval = pre_spt_idlePublishInterval;  // restore idlePublishInterval
-        opParams.minPublishInterval = pre_spt_minPublishInterval;    // restore minPublishInterval
-        valveState = valvePreSPT;
-        applyValveState(valvePreSPT, false);                         // restore the valveState to state before test
-        Serial.println(F("SPT event end: Aborted due to water demand"));
+            // report consecutive aborts attribute
+            sptConsecAborts++;
+            sprintf(msg, "{\"consec_aborts\": \"%d\"}", sptConsecAborts);
+            mqttClient.publish(SPT_DATA_STATUS_TOPIC"/attributes", msg, true);  
+            Serial.printf("%s  MQTT SENT: %s/%s \n", myTZ.dateTime("[H:i:s.v]").c_str(), SPT_DATA_STATUS_TOPIC"/attributes", msg);
+
+            // Restore previous states
+            opParams.idlePublishInterval = pre_spt_idlePublishInterval;  // restore idlePublishInterval
+            opParams.minPublishInterval = pre_spt_minPublishInterval;    // restore minPublishInterval
+            valveState = valvePreSPT;
+            applyValveState(valvePreSPT, false);                         // restore the valveState to state before test
+            Serial.println(F("SPT event end: Aborted due to water demand"));
+            journalAppend(EVENT_SPT_ABORT, 1, medianPressure, 0);
+            if (opParams.sptAutoSchedule == 1)
+              sptScheduleNext(true);
+          }
+        }
       }
     }
   }
+
+  rtcBreadcrumb(BC_IDLE);
+  if (millis() - lastRtcSave >= RTC_SNAPSHOT_INTERVAL_MS)
+    rtcSnapshotSave();
 }
@@ -0,0 +1,388 @@
+#!/usr/bin/env python3
+"""Fleet-scale MQTT load generator for The Water Main Monitor.
+
+Runs N simulated controllers against a broker (normally a local mosquitto) and
+reports what the fleet costs the broker as N grows: messages/sec, bytes/sec,
+retained store growth and command round-trip latency.
+
+Each simulated controller approximates the firmware's MQTT pattern from src/main.cpp:
+  - connect with the LWT, then the postConnectSync() announcements
+    (LWT, version, last_boot, spt_data_status, params, valve, last_reset - all retained)
+  - a pressure sample every sensorReadInterval, published with the temperature when the
+    change since the last publish exceeds sptPressureDrop (no sooner than minPublishInterval)
+    or idlePublishInterval has passed - publishMode 0, the default
+  - a fixture_event for every simulated water draw
+  - mqtt_stats (retained) every 15 minutes
+  - answers the ping command on PONG_TOPIC, which is how round-trip latency is timed
+Version, defaults, SPT status strings, the stats interval and the per-message byte
+overhead are read from the #defines in src/main.cpp (--firmware), so those follow the
+firmware.  The topics, payload layouts and the publish rule are copied by hand - keep
+them in step when the firmware changes them.  Pressure is a synthetic noise & draw model.
+
+The firmware topics are fixed, so simulated unit i uses <prefix>/<i>/watermain/...
+
+Broker figures come from mosquitto's $SYS tree - set "sys_interval 1" in
+mosquitto.conf for short steps.  Client-side counts are always reported as well.
+
+Requires paho-mqtt (pip install paho-mqtt).
+
+Example:
+  python3 tools/fleet_load.py --steps 1,10,50,100 --duration 120 --idle-publish-interval 60000
+"""
+
+import argparse
+import json
+import math
+import os
+import random
+import re
+import sys
+import threading
+import time
+
+import paho.mqtt.client as mqtt
+
+MQTT_KEEPALIVE_SECS = 15              # PubSubClient default
+FW = {}                               # #define name -> value from the firmware source
+SYS_TOPICS = {
+    "$SYS/broker/messages/received": "msgs_in",
+    "$SYS/broker/messages/sent": "msgs_out",
+    "$SYS/broker/bytes/received": "bytes_in",
+    "$SYS/broker/bytes/sent": "bytes_out",
+    "$SYS/broker/retained messages/count": "retained",
+    "$SYS/broker/clients/connected": "clients",
+}
+
+
+def firmware_defines(path):
+    """Simple #define constants of the firmware - numbers as int/float, quoted strings without quotes"""
+    defines = {}
+    pattern = re.compile(r'^#define\s+(\w+)\s+("[^"]*"|[-\w.]+)')
+    with open(path) as f:
+        for line in f:
+            m = pattern.match(line)
+            if not m:
+                continue
+            value = m.group(2)
+            if value.startswith('"'):
+                defines[m.group(1)] = value[1:-1]
+                continue
+            for kind in (int, float):
+                try:
+                    defines[m.group(1)] = kind(value)
+                    break
+                except ValueError:
+                    pass
+    return defines
+
+
+def new_client(client_id):
+    if hasattr(mqtt, "CallbackAPIVersion"):  # paho-mqtt 2.x - callbacks below take both signatures
+        return mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id)
+    return mqtt.Client(client_id=client_id)
+
+
+class Controller:
+    """One simulated monitor - publish logic mirrors loop() & postConnectSync()"""
+
+    def __init__(self, index, args):
+        self.args = args
+        self.base = "%s/%d/watermain" % (args.prefix, index)
+        self.unit_prefix = len("%s/%d/" % (args.prefix, index))
+        self.client = new_client("%s-%d" % (args.prefix, index))
+        if args.user:
+            self.client.username_pw_set(args.user, args.password)
+        self.client.will_set(self.base + "/status/LWT", "Disconnected", qos=2, retain=True)
+        self.client.on_connect = self.on_connect
+        self.client.on_message = self.on_message
+        self.lock = threading.Lock()
+        self.msgs = self.bytes = self.retained = self.retained_bytes = 0     # CountingMqttClient
+        self.received = self.received_bytes = self.connects = self.attempts = 0  # struct MqttStats
+        self.started = time.monotonic()
+        self.last_report = self.started
+        self.last_msgs = self.last_bytes = 0
+        self.boot = time.strftime("%Y-%m-%dT%H:%M:%S%z")
+        self.reset_reported = False
+        self.static_psi = random.uniform(55, 70)
+        self.psi1 = 0.0                # psiTminus1 - value at the last publish
+        self.last_publish = 0.0
+        self.next_read = time.monotonic() + random.uniform(0, args.read_interval / 1000)
+        self.next_stats = time.monotonic() + FW["MQTT_STATS_INTERVAL_MS"] / 1000
+        self.draw_end = 0.0
+        self.draw_start = 0.0
+        self.draw_depth = 0.0
+
+    def publish(self, topic, payload, retain=False):
+        self.client.publish(self.base + topic, payload, retain=retain)
+        # counted as CountingMqttClient::publish() does, on the firmware topic without the unit prefix
+        size = len(self.base[self.unit_prefix:] + topic) + len(payload) + FW["MQTT_PUBLISH_OVERHEAD_BYTES"]
+        with self.lock:
+            self.msgs += 1
+            self.bytes += size
+            if retain:
+                self.retained += 1
+                self.retained_bytes += size
+
+    def connect(self):
+        self.attempts += 1
+        self.client.connect_async(self.args.host, self.args.port, MQTT_KEEPALIVE_SECS)
+        self.client.loop_start()
+
+    def disconnect(self):
+        self.client.disconnect()
+        self.client.loop_stop()
+
+    def on_connect(self, client, userdata, flags, rc, properties=None):
+        if rc != 0:
+            return
+        a = self.args
+        self.connects += 1
+        client.subscribe(self.base + "/cmd/#")
+        self.publish("/status/LWT", "Connected", True)
+        self.publish("/report/version", FW["VERSION"], True)
+        self.publish("/report/last_boot", self.boot, True)
+        self.publish("/spt_data_status", FW["SPT_DATA_INVALID"], True)
+        # formatParams()
+        params = ("{\"valveState\": \"1\", \"version\": \"%s\", \"valveInstalled\": \"%d\", \"pressureInstalled\": \"%d\", "
+                  "\"idlePublishInterval\": \"%d\", \"minPublishInterval\": \"%d\", \"sensorReadInterval\": \"%d\", "
+                  "\"sptPressureDrop\": \"%.2f\", \"sptDemandWaterPercentDrop\": \"%.f\", \"sptDuration\": \"%d\", "
+                  "\"adaptiveSampling\": \"%d\", \"fastReadInterval\": \"%d\", \"slowReadInterval\": \"%d\", \"adaptiveSlopeThreshold\": \"%.2f\", "
+                  "\"publishMode\": \"%d\", \"sdtDeviation\": \"%.2f\", \"passiveStartHour\": \"%d\", \"passiveEndHour\": \"%d\", \"sptAutoSchedule\": \"%d\", "
+                  "\"valveExerciseDays\": \"%d\", \"valveExerciseMode\": \"%d\", \"sptThermalMode\": \"%d\", \"sptThermalCoeff\": \"%.2f\", \"leakSensors\": \"0\"}\n\n"
+                  % (FW["VERSION"], FW["INITIAL_VALVE_INSTALLED_STATE"], FW["INITIAL_PRESSURE_SENSOR_INSTALLED_STATE"],
+                     a.idle_publish_interval, a.min_publish_interval, a.read_interval, a.pressure_drop,
+                     FW["DEFAULT_SPT_DEMAND_WATER_PERCENT_DROP"], FW["DEFAULT_SPT_TEST_DURATION_MINUTES"], FW["DEFAULT_ADAPTIVE_SAMPLING"],
+                     FW["DEFAULT_FAST_READ_INTERVAL_MS"], FW["DEFAULT_SLOW_READ_INTERVAL_MS"], FW["DEFAULT_ADAPTIVE_SLOPE_THRESHOLD"],
+                     FW["DEFAULT_PUBLISH_MODE"], FW["DEFAULT_SDT_DEVIATION"], FW["DEFAULT_PASSIVE_START_HOUR"], FW["DEFAULT_PASSIVE_END_HOUR"],
+                     FW["DEFAULT_SPT_AUTO_SCHEDULE"], FW["DEFAULT_VALVE_EXERCISE_DAYS"], FW["DEFAULT_VALVE_EXERCISE_MODE"],
+                     FW["DEFAULT_SPT_THERMAL_MODE"], FW["DEFAULT_SPT_THERMAL_COEFF"]))
+        self.publish("/report/params", params, True)
+        self.publish("/valve_zeroisclosed", "1", True)
+        if not self.reset_reported:
+            self.publish("/report/last_reset", "{\"boot\": \"%s\", \"reason\": \"Power On\", \"breadcrumb\": \"unknown\", \"restored\": \"0\", "
+                         "\"snapshot_age_s\": \"-1\", \"warm_restarts\": \"0\", \"discarded\": \"0\", \"spt\": \"none\"}" % self.boot, True)
+            self.reset_reported = True
+
+    def on_message(self, client, userdata, message):
+        with self.lock:
+            self.received += 1
+            self.received_bytes += len(message.topic) - self.unit_prefix + len(message.payload) + FW["MQTT_PUBLISH_OVERHEAD_BYTES"]
+        if message.topic == self.base + "/cmd/ping":
+            self.publish("/report/pong", message.payload.decode(errors="replace"))
+
+    def step(self, now):
+        """One sensor read if due - the publish rule of loop() in publishMode 0"""
+        a = self.args
+        if now < self.next_read:
+            return
+        self.next_read = max(self.next_read + a.read_interval / 1000, now)   # no catch-up burst after a pause
+        if (self.draw_end == 0) and (random.random() < a.draws_per_hour * a.read_interval / 3600000):
+            self.draw_start = now
+            self.draw_end = now + random.uniform(10, 300)
+            self.draw_depth = random.uniform(3, 15)
+        psi = self.static_psi + random.gauss(0, a.noise)
+        if self.draw_end:
+            psi -= self.draw_depth
+            if now >= self.draw_end:
+                self.publish("/fixture_event", "{\"time\": \"%s\", \"fixture\": \"unknown\", \"duration_secs\": \"%.1f\", \"depth\": \"%.2f\", \"mean_drop\": \"%.2f\"}"
+                             % (time.strftime("%Y-%m-%dT%H:%M:%S%z"), self.draw_end - self.draw_start, self.draw_depth, self.draw_depth))
+                self.draw_end = 0
+        since = (now - self.last_publish) * 1000
+        if (since > a.idle_publish_interval) or ((abs(self.psi1 - psi) > a.pressure_drop) and (since >= a.min_publish_interval)):
+            self.publish("/water_pressure", "%.2f" % psi)
+            self.publish("/water_temperature", "%.2f" % random.uniform(50, 60))
+            self.last_publish = now
+            self.psi1 = psi
+        if now >= self.next_stats:
+            self.next_stats += FW["MQTT_STATS_INTERVAL_MS"] / 1000
+            self.publish_stats(now)
+
+    def publish_stats(self, now):
+        """mqttStatsPublish() - this report is counted in msgs as the firmware does"""
+        mins = (now - self.last_report) / 60 or 1
+        with self.lock:
+            msgs, size = self.msgs + 1, self.bytes
+            payload = ("{\"uptime_s\": \"%d\", \"msgs\": \"%d\", \"bytes\": \"%d\", \"retained_msgs\": \"%d\", \"retained_bytes\": \"%d\", "
+                       "\"msgs_per_min\": \"%.2f\", \"bytes_per_min\": \"%.1f\", \"received\": \"%d\", \"received_bytes\": \"%d\", "
+                       "\"connects\": \"%d\", \"connect_attempts\": \"%d\"}"
+                       % (now - self.started, msgs, size, self.retained, self.retained_bytes,
+                          (msgs - self.last_msgs) / mins, (size - self.last_bytes) / mins,
+                          self.received, self.received_bytes, self.connects, self.attempts))
+        self.publish("/report/mqtt_stats", payload, True)
+        self.last_report = now
+        self.last_msgs, self.last_bytes = self.msgs, self.bytes
+
+
+class Monitor:
+    """Broker $SYS figures and ping round trips, on a client of its own"""
+
+    def __init__(self, args):
+        self.args = args
+        self.client = new_client("%s-monitor" % args.prefix)
+        if args.user:
+            self.client.username_pw_set(args.user, args.password)
+        self.client.on_connect = self.on_connect
+        self.client.on_message = self.on_message
+        self.lock = threading.Lock()
+        self.sys = {}
+        self.pending = {}
+        self.rtts = []
+
+    def on_connect(self, client, userdata, flags, rc, properties=None):
+        client.subscribe("$SYS/broker/#")
+        client.subscribe(self.args.prefix + "/+/watermain/report/pong")
+
+    def on_message(self, client, userdata, message):
+        key = SYS_TOPICS.get(message.topic)
+        if key:
+            try:
+                with self.lock:
+                    self.sys[key] = float(message.payload)
+            except ValueError:
+                pass
+        elif message.topic.endswith("/report/pong"):
+            now = time.monotonic()
+            with self.lock:
+                sent = self.pending.pop(message.payload.decode(errors="replace"), None)
+                if sent is not None:
+                    self.rtts.append((now - sent) * 1000)
+
+    def start(self):
+        self.client.connect(self.args.host, self.args.port, 60)
+        self.client.loop_start()
+
+    def ping(self, controller):
+        token = "%s-%d" % (controller.base, random.getrandbits(32))
+        with self.lock:
+            self.pending[token] = time.monotonic()
+        self.client.publish(controller.base + "/cmd/ping", token)
+
+    def snapshot(self):
+        with self.lock:
+            return dict(self.sys)
+
+    def take_pings(self):
+        with self.lock:
+            rtts, lost = self.rtts, len(self.pending)
+            self.rtts, self.pending = [], {}
+        return rtts, lost
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))]
+
+
+def run_step(n, controllers, monitor, args):
+    """Grows the fleet to n & measures - the connect burst of new units (or of all with --storm) is part of the step"""
+    sys_start = monitor.snapshot()
+    sent_start = sum(c.msgs for c in controllers), sum(c.bytes for c in controllers)
+    start = time.monotonic()
+    while len(controllers) < n:
+        controllers.append(Controller(len(controllers), args))
+        controllers[-1].connect()
+    if args.storm:                        # every unit reconnects at once, as after a broker restart
+        for c in controllers:
+            c.disconnect()
+        for c in controllers:
+            c.connect()
+    time.sleep(args.settle)
+    monitor.take_pings()
+    ping_start = next_ping = time.monotonic()
+    while time.monotonic() - ping_start < args.duration:
+        now = time.monotonic()
+        for c in controllers:
+            c.step(now)
+        if now >= next_ping:
+            monitor.ping(random.choice(controllers))
+            next_ping += 1 / args.ping_rate
+        time.sleep(0.01)
+    time.sleep(args.settle)               # late pongs & the next $SYS update
+    secs = time.monotonic() - start
+    sys_end = monitor.snapshot()
+    rtts, lost = monitor.take_pings()
+    sent = sum(c.msgs for c in controllers) - sent_start[0], sum(c.bytes for c in controllers) - sent_start[1]
+
+    def rate(key):
+        if (key in sys_start) and (key in sys_end):
+            return (sys_end[key] - sys_start[key]) / secs
+        return float("nan")
+
+    return {
+        "controllers": n,
+        "sim_msgs_per_s": sent[0] / secs,
+        "sim_bytes_per_s": sent[1] / secs,
+        "broker_msgs_in_per_s": rate("msgs_in"),
+        "broker_msgs_out_per_s": rate("msgs_out"),
+        "broker_bytes_in_per_s": rate("bytes_in"),
+        "broker_bytes_out_per_s": rate("bytes_out"),
+        "retained": sys_end.get("retained", float("nan")),
+        "retained_growth": sys_end.get("retained", float("nan")) - sys_start.get("retained", float("nan")),
+        "rtt_ms_p50": percentile(rtts, 50),
+        "rtt_ms_p95": percentile(rtts, 95),
+        "rtt_ms_max": max(rtts) if rtts else float("nan"),
+        "pings_lost": lost,
+    }
+
+
+def main():
+    firmware = argparse.ArgumentParser(add_help=False)
+    firmware.add_argument("--firmware", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "main.cpp"),
+                          help="firmware source the constants & defaults are read from")
+    FW.update(firmware_defines(firmware.parse_known_args()[0].firmware))
+
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0], parents=[firmware])
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--user")
+    parser.add_argument("--password")
+    parser.add_argument("--prefix", default="sim", help="simulated units publish under <prefix>/<n>/watermain/")
+    parser.add_argument("--steps", default="1,10,50,100", help="comma separated fleet sizes, run in order")
+    parser.add_argument("--duration", type=float, default=120, help="seconds measured per step")
+    parser.add_argument("--settle", type=float, default=3, help="seconds before & after each step for connects & $SYS updates")
+    parser.add_argument("--storm", action="store_true", help="reconnect every unit at the start of each step")
+    parser.add_argument("--idle-publish-interval", type=int, default=FW["DEFAULT_IDLE_PUBLISH_INTERVAL_MS"], help="ms - firmware idlePublishInterval")
+    parser.add_argument("--min-publish-interval", type=int, default=FW["DEFAULT_MIN_PUBLISH_INTERVAL_MS"], help="ms - firmware minPublishInterval")
+    parser.add_argument("--read-interval", type=int, default=FW["DEFAULT_SENSOR_READ_INTERVAL_MS"], help="ms - firmware sensorReadInterval")
+    parser.add_argument("--pressure-drop", type=float, default=FW["DEFAULT_SPT_REPORT_PSI_DROP"], help="PSI - firmware sptPressureDrop")
+    parser.add_argument("--noise", type=float, default=0.05, help="PSI - standard deviation of simulated sensor noise")
+    parser.add_argument("--draws-per-hour", type=float, default=4, help="simulated water draws per unit per hour")
+    parser.add_argument("--ping-rate", type=float, default=2, help="ping commands per second, each to a random unit")
+    parser.add_argument("--json", action="store_true", help="print one JSON object per step instead of a table")
+    args = parser.parse_args()
+
+    monitor = Monitor(args)
+    try:
+        monitor.start()
+    except OSError as e:
+        sys.exit("Cannot connect to %s:%d - %s" % (args.host, args.port, e))
+    deadline = time.monotonic() + 15      # mosquitto's default sys_interval is 10 s
+    while ("msgs_in" not in monitor.snapshot()) and (time.monotonic() < deadline):
+        time.sleep(0.2)
+    if "msgs_in" not in monitor.snapshot():
+        print("No $SYS statistics from the broker - broker columns will be nan", file=sys.stderr)
+    controllers = []
+    if not args.json:
+        print("%6s %9s %10s %9s %9s %11s %11s %9s %8s %8s %8s %8s %5s" % (
+            "units", "sim_msg/s", "sim_byte/s", "brk_in/s", "brk_out/s", "brk_Bin/s", "brk_Bout/s",
+            "retained", "ret_grow", "rtt_p50", "rtt_p95", "rtt_max", "lost"))
+    try:
+        for n in [int(s) for s in args.steps.split(",")]:
+            r = run_step(n, controllers, monitor, args)
+            if args.json:
+                print(json.dumps({k: (None if isinstance(v, float) and math.isnan(v) else v) for k, v in r.items()}), flush=True)
+            else:
+                print("%6d %9.2f %10.1f %9.2f %9.2f %11.1f %11.1f %9.0f %8.0f %8.1f %8.1f %8.1f %5d" % (
+                    r["controllers"], r["sim_msgs_per_s"], r["sim_bytes_per_s"], r["broker_msgs_in_per_s"], r["broker_msgs_out_per_s"],
+                    r["broker_bytes_in_per_s"], r["broker_bytes_out_per_s"], r["retained"], r["retained_growth"],
+                    r["rtt_ms_p50"], r["rtt_ms_p95"], r["rtt_ms_max"], r["pings_lost"]), flush=True)
+    finally:
+        for c in controllers:
+            c.disconnect()
+        monitor.client.loop_stop()
+
+
+if __name__ == "__main__":
+    main()